@@ -0,0 +1,17 @@
+#ifndef ALLOCATIONCHECK_H
+#define ALLOCATIONCHECK_H
+
+// When the project is built with ALLOCATION_CHECK defined, the heap allocations of the tracked threads (the thread that
+// runs a step and the workers of the thread pool) are counted, so that Grid can check that its steps don't allocate once
+// the simulation has warmed up. The allocations of the other threads (eg: Qt's) are not counted.
+// With the GNU C library, malloc, calloc, realloc and the aligned allocations (aligned_alloc, posix_memalign, memalign)
+// are hooked, which also counts Qt containers and the aligned forms of operator new; elsewhere, only operator new is.
+
+#ifdef ALLOCATION_CHECK
+
+void track_allocations_of_current_thread(bool tracked);
+long long get_tracked_allocations();
+
+#endif
+
+#endif // ALLOCATIONCHECK_H
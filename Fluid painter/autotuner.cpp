@@ -0,0 +1,97 @@
+#include <QtGlobal>
+#include <algorithm>
+#include "autotuner.h"
+
+inline constexpr int measured_frames = 5; // the frames measured for each candidate, whose median time is its score
+inline constexpr int min_tuned_particles = 500; // with fewer particles, a step is too short to measure
+inline constexpr float retune_ratio = 1.5; // the tuning starts again when the number of particles changes by this ratio
+
+void AutoTuner::start(const Config& current, AutoTuning _mode, int _max_threads, int nb_particles, float influence_radius) {
+    // Starts tuning from the current configuration, for the current conditions
+    mode = _mode;
+    max_threads = qMax(1, _max_threads);
+    tuned_nb_particles = nb_particles;
+    tuned_influence_radius = influence_radius;
+    tuned = true;
+    best = current;
+    best.nb_threads = qMin(best.nb_threads, max_threads);
+    start_setting(Setting::threads);
+}
+
+bool AutoTuner::needs_restart(int nb_particles, float influence_radius, int _max_threads) const {
+    if (nb_particles < min_tuned_particles) return false;
+    if (!tuned) return true;
+    return influence_radius != tuned_influence_radius
+        || _max_threads != max_threads
+        || nb_particles > tuned_nb_particles * retune_ratio
+        || nb_particles * retune_ratio < tuned_nb_particles;
+}
+
+void AutoTuner::record_frame(float time_per_step) {
+    // Records the time per step of a frame run with the current candidate, and moves on to the next candidate once it
+    // was measured enough
+    if (!tuning) return;
+    if (candidate_frames++ == 0) return;
+
+    samples.push_back(time_per_step);
+    if (int(samples.size()) < measured_frames) return;
+
+    std::nth_element(samples.begin(), samples.begin() + samples.size() / 2, samples.end());
+    scores.push_back(samples[samples.size() / 2]);
+    samples.clear();
+    candidate_frames = 0;
+    candidate++;
+    if (candidate < int(candidates.size())) return;
+
+    // the setting is tuned: the next ones start from its best candidate
+    best = candidates[std::min_element(scores.begin(), scores.end()) - scores.begin()];
+    switch (setting) {
+    case Setting::threads:
+        start_setting(mode == AutoTuning::full ? Setting::cell_reach : Setting::chunks);
+        break;
+    case Setting::cell_reach:
+        start_setting(Setting::chunks);
+        break;
+    default:
+        start_setting(Setting::done);
+        break;
+    }
+}
+
+void AutoTuner::start_setting(Setting _setting) {
+    // Lists the candidates of the setting: the best configuration with each value of the setting
+    setting = _setting;
+    candidates.clear();
+    scores.clear();
+    samples.clear();
+    candidate = 0;
+    candidate_frames = 0;
+
+    Config config = best;
+    switch (setting) {
+    case Setting::threads:
+        // the powers of two below the number of cores, and all the cores
+        for (int nb_threads = 1; nb_threads < max_threads; nb_threads *= 2) {
+            config.nb_threads = nb_threads;
+            candidates.push_back(config);
+        }
+        config.nb_threads = max_threads;
+        candidates.push_back(config);
+        break;
+    case Setting::cell_reach:
+        for (int cell_reach : {1, 2}) {
+            config.cell_reach = cell_reach;
+            candidates.push_back(config);
+        }
+        break;
+    case Setting::chunks:
+        for (int chunks_per_thread : {4, 8, 16}) {
+            config.chunks_per_thread = chunks_per_thread;
+            candidates.push_back(config);
+        }
+        break;
+    case Setting::done:
+        break;
+    }
+    tuning = !candidates.empty();
+}
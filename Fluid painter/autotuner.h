@@ -0,0 +1,57 @@
+#ifndef AUTOTUNER_H
+#define AUTOTUNER_H
+
+#include <vector>
+
+// What Grid tunes at run time: nothing, only the settings that don't change the results (the number of threads and of
+// chunks), or also the size of the cells
+enum class AutoTuning {off, threads_and_chunks, full};
+
+class AutoTuner
+{
+    /**
+      * This class looks for the fastest configuration of the grid on the live simulation: each candidate configuration runs
+      * for a few frames, and the one with the smallest time per step is kept. The settings are tuned one after the other
+      * (the number of threads, then the size of the cells, then the number of chunks per thread), each one from the best
+      * values found for the previous ones, so that only a few candidates are tried instead of every combination.
+      * The first frame of a candidate isn't measured, since it pays for the switch (new threads, new cells...).
+      * The tuning starts again when the number of particles or the influence radius changes a lot, or when the number of
+      * cores available changes.
+      */
+
+public:
+    struct Config {
+        int nb_threads;
+        int cell_reach; // see Grid::set_cell_reach
+        int chunks_per_thread;
+    };
+
+    void start(const Config& current, AutoTuning mode, int max_threads, int nb_particles, float influence_radius);
+    bool needs_restart(int nb_particles, float influence_radius, int _max_threads) const;
+    bool is_tuning() const {return tuning;}
+    bool has_started() const {return tuned;}
+    const Config& get_config() const {return tuning ? candidates[candidate] : best;}
+    void record_frame(float time_per_step);
+
+private:
+    enum class Setting {threads, cell_reach, chunks, done};
+
+    void start_setting(Setting _setting);
+
+    bool tuning = false;
+    bool tuned = false; // a tuning was started for the current conditions
+    AutoTuning mode = AutoTuning::off;
+    int max_threads = 1; // the most threads tried, the cores available to the process
+    int tuned_nb_particles = 0; // the conditions of the last tuning
+    float tuned_influence_radius = 0;
+
+    Setting setting = Setting::done;
+    std::vector<Config> candidates; // the candidates of the setting being tuned
+    int candidate = 0;
+    int candidate_frames = 0; // the frames run with the candidate, including the unmeasured one
+    std::vector<float> samples; // the times per step measured for the candidate
+    std::vector<float> scores; // the median time per step of each candidate already measured
+    Config best; // the configuration the grid had when the tuning started, until a better one is measured
+};
+
+#endif // AUTOTUNER_H
@@ -0,0 +1,91 @@
+#include <QtGlobal>
+#include <QThread>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include "availablecores.h"
+
+#ifdef Q_OS_LINUX
+#include <sched.h>
+
+static int quota_cores(long long quota, long long period) {
+    // Returns the cores needed to use the whole quota, or 0 if there is no quota
+    if (quota <= 0 || period <= 0) return 0;
+    return int((quota + period - 1) / period);
+}
+
+static int cgroup_v2_cores(const std::string& dir) {
+    // cpu.max holds "<quota> <period>", or "max <period>" without quota
+    std::ifstream file(dir + "/cpu.max");
+    std::string quota;
+    long long period = 0;
+    if (!(file >> quota >> period) || quota == "max") return 0;
+    return quota_cores(std::atoll(quota.c_str()), period);
+}
+
+static int cgroup_v1_cores(const std::string& dir) {
+    // cpu.cfs_quota_us is -1 without quota
+    std::ifstream quota_file(dir + "/cpu.cfs_quota_us");
+    std::ifstream period_file(dir + "/cpu.cfs_period_us");
+    long long quota = 0;
+    long long period = 0;
+    if (!(quota_file >> quota) || !(period_file >> period)) return 0;
+    return quota_cores(quota, period);
+}
+
+template<typename Function>
+static int hierarchy_cores(const std::string& mount, std::string path, const Function& level_cores) {
+    // Returns the smallest quota of the cgroup at path and of its parents up to the mount point (the quota of a parent also
+    // limits its children), or 0 if none has one. The levels that aren't mounted (eg: in a container) are skipped.
+    if (path == "/") path.clear();
+    int cores = 0;
+    while (true) {
+        const int level = level_cores(mount + path);
+        if (level > 0) cores = cores > 0 ? qMin(cores, level) : level;
+        if (path.empty()) return cores;
+        path.erase(path.rfind('/'));
+    }
+}
+
+static int cgroup_cores() {
+    // Returns the CPU quota of the process's cgroups in cores, or 0 if there is none. The lines of /proc/self/cgroup are
+    // "<id>:<controllers>:<path>": the cgroup v2 one has no controllers, the cgroup v1 ones list theirs (eg: "cpu,cpuacct").
+    std::ifstream file("/proc/self/cgroup");
+    std::string line;
+    int cores = 0;
+    auto add_quota = [&](int quota) {
+        if (quota > 0) cores = cores > 0 ? qMin(cores, quota) : quota;
+    };
+
+    while (std::getline(file, line)) {
+        const size_t first_colon = line.find(':');
+        const size_t second_colon = line.find(':', first_colon + 1);
+        if (first_colon == std::string::npos || second_colon == std::string::npos) continue;
+        const std::string controllers = line.substr(first_colon + 1, second_colon - first_colon - 1);
+        const std::string path = line.substr(second_colon + 1);
+
+        if (controllers.empty()) {
+            add_quota(hierarchy_cores("/sys/fs/cgroup", path, cgroup_v2_cores));
+        }
+        else if (("," + controllers + ",").find(",cpu,") != std::string::npos) {
+            for (const char* mount : {"/sys/fs/cgroup/cpu,cpuacct", "/sys/fs/cgroup/cpu"}) {
+                add_quota(hierarchy_cores(mount, path, cgroup_v1_cores));
+            }
+        }
+    }
+    return cores;
+}
+#endif
+
+int count_available_cores() {
+    int nb_cores = QThread::idealThreadCount();
+#ifdef Q_OS_LINUX
+    cpu_set_t affinity;
+    if (sched_getaffinity(0, sizeof(affinity), &affinity) == 0) {
+        nb_cores = CPU_COUNT(&affinity);
+    }
+    const int quota = cgroup_cores();
+    if (quota > 0) nb_cores = qMin(nb_cores, quota);
+#endif
+    return qMax(1, nb_cores);
+}
@@ -0,0 +1,10 @@
+#ifndef AVAILABLECORES_H
+#define AVAILABLECORES_H
+
+// Returns the number of cores the process can actually use: the cores of its CPU affinity mask, bounded by the CPU quota of
+// its cgroup (cgroup v2 cpu.max, or v1 cpu.cfs_quota_us / cpu.cfs_period_us) rounded up, so that a container limited to
+// 2 CPUs of a 32-core machine gets 2 threads instead of 32 throttled ones. Both can change while the process runs, so it is
+// meant to be called again from time to time. Outside of Linux, returns the number of cores of the machine.
+int count_available_cores();
+
+#endif // AVAILABLECORES_H
@@ -0,0 +1,55 @@
+#ifndef CELLHASHTABLE_H
+#define CELLHASHTABLE_H
+
+#include <QPoint>
+#include <vector>
+
+// How Grid stores its cells: in a dense array that covers the whole world, or in a hash table of the cells that contain particles
+enum class CellStorage {dense, hashed};
+
+class CellHashTable
+{
+    /**
+      * This class gives compact ids to the cells of a grid that contain particles, so that the data of the cells is stored
+      * in arrays whose size follows the number of occupied cells instead of the size of the world. The id of a cell is found
+      * from its position in the grid with an open addressing hash table (linear probing), which is kept at most half full.
+      * The ids are given in the order the cells are inserted, and stay valid until the table is cleared.
+      */
+
+public:
+    CellHashTable();
+
+    inline int find(QPoint pos) const {
+        // Returns the id of the cell at the grid position, or -1 if it was never inserted
+        for (quint32 slot = hash(pos) & mask; ; slot = (slot + 1) & mask) {
+            const Slot& s = table[slot];
+            if (s.id < 0 || (s.x == pos.x() && s.y == pos.y())) return s.id;
+        }
+    }
+
+    int insert(QPoint pos);
+    void clear(int expected_size);
+    int size() const {return int(positions.size());}
+    size_t capacity() const {return table.capacity() + positions.capacity();}
+    QPoint get_pos(int id) const {return positions[id];}
+
+private:
+    struct Slot {
+        int x;
+        int y;
+        int id; // -1: empty slot
+    };
+
+    static inline quint32 hash(QPoint pos) {
+        quint32 hash = quint32(pos.x()) * 73856093u ^ quint32(pos.y()) * 19349663u;
+        return hash ^ (hash >> 16);
+    }
+
+    void place(int id);
+
+    std::vector<Slot> table; // the number of slots is a power of two (not named slots, which is a Qt keyword)
+    quint32 mask;
+    std::vector<QPoint> positions; // the position of each cell, by id
+};
+
+#endif // CELLHASHTABLE_H
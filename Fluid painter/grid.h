@@ -5,90 +5,655 @@
 #include <QSizeF>
 #include <QVector>
 #include <QVector2D>
-#include <QRandomGenerator>
+#include <atomic>
+#include <chrono>
 #include <memory>
 #include <utility>
 #include <QPointF>
-#include "particle.h"
+#include <vector>
+#include "cellhashtable.h"
+#include "autotuner.h"
+#include "floatbatch.h"
+#include "particledata.h"
+#include "simparams.h"
+#include "smoothingkernels.h"
+#include "neighborlist.h"
+#include "threadpool.h"
 
 #include <QDebug>
 
 using std::shared_ptr;
 using std::pair;
 
-class Particle;
-
 class Grid
 {
     /**
       *This class represents the grid that divides the world into cells. This is an optimisation that allows to avoid
       *having to loop over all the particles for each particle in order to check proximity forces (pressure, viscosity...).
       *Instead, the particles only loop over the neighboring cells.
-      *Cells are identified by an id. The bottom left cell's id is 0, and the top right cell has the maximum id.
+      *Cells are identified by an id. The grid is surrounded by a layer of empty ghost cells, so that every cell has its 8
+      *neighbors and the neighbor cells are found without testing the borders. The ids go row by row, from the bottom left
+      *ghost cell (id 0) to the top right one.
+      *The cells can also be a fraction of the influence radius (see set_cell_reach): the neighbors are then searched in the
+      *5x5 cells around a particle (with as many layers of ghost cells), and only in the cells of each row that the influence
+      *circle touches, which covers less area than the 3x3 cells of one influence radius.
+      *At the beginning of each step, the particles are sorted by cell with a counting sort, so that each cell is a contiguous
+      *range of the sorted index array. The sort also lists the cells that contain particles, and the passes only visit these
+      *ones, so that the cost of a step follows the number of particles rather than the size of the world.
+      *With the hashed storage, chosen for large worlds, the ids are only given to the cells that contain particles, by a hash
+      *table (see CellHashTable), so that the memory follows the number of particles too. There are no ghost cells then, and
+      *the neighbor cells are looked up one by one instead of by rows.
+      *When the fluid clumps, a cell can hold hundreds of particles, which each of its neighbors would test. Such crowded cells
+      *are subdivided in a quadtree whose nodes keep the bounding box of their particles, so that the neighbor searches skip
+      *the parts of the cell that are out of reach.
       */
 public:
-    Grid(QPoint _nb_cells, const QSizeF& _world_size, shared_ptr<float> _g, shared_ptr<float> _collision_damping,
-         shared_ptr<float> _fluid_density, shared_ptr<float> _pressure_multiplier, shared_ptr<float> _near_pressure_multiplier,
-         shared_ptr<float> _viscosity_multiplier);
+    Grid(QPoint _nb_cells, const QSizeF& _world_size, shared_ptr<SimParamsChannel> _params_channel, shared_ptr<ThreadPool> _thread_pool,
+         CellStorage _cell_storage);
 
-    void add_particle(shared_ptr<Particle> particle);
+    int add_particle(QPointF pos, QVector2D speed);
     void update_particles(float time_step);
+    int update_particles_for(float duration);
     void change_grid(QPoint _nb_cells);
+    void set_neighbor_list_skin(float skin);
+    void set_smoothing_kernel(SmoothingKernel kernel) {smoothing_kernel = kernel;}
+    void set_symmetric_forces(bool enabled) {symmetric_forces = enabled; steps_since_change = 0;}
+    void set_reorder_interval(int steps) {reorder_interval = steps;}
+    void set_time_step_factors(float _cfl_factor, float _force_factor) {cfl_factor = _cfl_factor; force_factor = _force_factor;}
+    void set_block_time_steps(bool enabled) {block_time_steps = enabled;}
+    void set_sleep_thresholds(float speed, float acceleration, int steps) {sleep_speed = speed; sleep_acceleration = acceleration; sleep_steps = steps;}
+    void set_cell_reach(int reach);
+    void set_chunks_per_thread(int chunks) {chunks_per_thread = chunks; steps_since_change = 0;}
+    void set_auto_tuning(AutoTuning mode) {auto_tuning = mode;}
+    void set_max_threads(int _max_threads);
+    float get_stable_time_step() const;
+    bool is_allocation_checked() const;
+
+    QPointF get_particle_pos(int id) const {return data.get_pos(data.id_slots[id]);}
+    QVector2D get_particle_speed(int id) const {return data.get_speed(data.id_slots[id]);}
+    float get_particle_density(int id) const {return data.density[data.id_slots[id]];}
+    float get_particle_pressure(int id) const {return data.pressure[data.id_slots[id]];}
+    bool is_particle_sleeping(int id) const {return !sleeping_cells.empty() && sleeping_cells[particle_cells[data.id_slots[id]]];}
 
-    float get_g() {return *g;}
-    float get_collision_damping() {return *collision_damping;}
+    float get_particle_radius() const {return params.particle_radius;}
+    float get_g() const {return params.g;}
+    float get_collision_damping() const {return params.collision_damping;}
 
 private:
-    void update_particles_pos_and_speed(float time_step, int start_cell_pos_x, int end_cell_pos_x);
-    void update_particles_pos_on_grid(int start_cell_id, int end_cell_id);
-    void update_predicted_pos(float time_step, int start_cell_id, int end_cell_id);
-    void update_densities(int start_cell_pos_x, int end_cell_pos_x);
-    int cell_id_from_world_pos(QPointF pos);
+    void update_particles_pos_and_speed(float time_step, int chunk);
+    template<typename Prologue>
+    void update_particles_pos_on_grid(const Prologue& prologue);
+    void update_particles_pos_on_grid();
+    void count_particles_in_cells(int task, int start_particle, int end_particle);
+    void add_hashed_cells();
+    void sort_particles_in_cells(int task, int start_particle, int end_particle);
+    void update_predicted_pos(float time_step, int start_particle, int end_particle);
+    void update_kernels(float influence_radius);
+    template<typename Kernels>
+    void update_densities_and_forces(const Kernels& kernels, float time_step);
+    template<typename Kernels>
+    void update_densities(const Kernels& kernels, int chunk);
+    template<typename Kernels>
+    void reset_densities(const Kernels& kernels, int start_particle, int end_particle);
+    template<typename Kernels>
+    void update_column_densities(const Kernels& kernels, int column);
+    void update_pressures(int start_particle, int end_particle);
+    inline void update_pressure(int p) {
+        data.pressure[p] = (data.density[p] - params.fluid_density) * params.pressure_multiplier;
+        data.near_pressure[p] = data.near_density[p] * params.near_pressure_multiplier;
+    }
+    void add_column_pair_forces(int column);
+    void integrate_particles(float time_step, int task, int start_particle, int end_particle);
+    template<typename Prologue>
+    bool neighbor_list_outdated(float influence_radius, const Prologue& prologue);
+    inline void record_motion(int task, int p) {
+        // Keeps the largest speed and acceleration of the task's particles, for the time step control
+        task_max_speed[task] = qMax(task_max_speed[task], data.next_vx[p] * data.next_vx[p] + data.next_vy[p] * data.next_vy[p]);
+        task_max_acceleration[task] = qMax(task_max_acceleration[task], data.last_acceleration[p]);
+    }
+    int update_particles_by_blocks(float duration);
+    void update_time_step_levels(int start_particle, int end_particle);
+    void update_active_cells(int start_index, int end_index);
+    void update_sleeping_cells(int start_index, int end_index);
+    void update_cell_calm(int cell);
+    void wake_cells_around(QPointF pos, float radius);
+    void wake_all_cells();
+    float get_stable_time_step(float speed, float acceleration) const;
+    inline bool is_near_active_cell(int cell) const {
+        // Whether a cell that may hold a neighbor of the cell's particles has an active particle: the cells of the stencil,
+        // or with the neighbor lists, the cells within their reach
+        const int reach = get_neighbor_reach();
+        bool near_active = false;
+        if (reach == cell_reach) {
+            for_each_cell_around(cell, [&](int n) {
+                if (cell_active_steps[n] == current_step) near_active = true;
+            });
+            return near_active;
+        }
+
+        const QPoint pos = grid_pos_from_cell_id(cell);
+        for (int row = qMax(pos.y() - reach, 0); row <= qMin(pos.y() + reach, nb_cells.y() - 1); row++) {
+            for (int column = qMax(pos.x() - reach, 0); column <= qMin(pos.x() + reach, nb_cells.x() - 1); column++) {
+                const int n = cell_id_from_grid_pos({column, row});
+                if (n >= 0 && cell_active_steps[n] == current_step) near_active = true;
+            }
+        }
+        return near_active;
+    }
+    inline int get_neighbor_reach() const {
+        // The most cells, along a row or a column, between the cells of two neighbors: the stencil's reach, or the lists'
+        return neighbor_list_skin > 0 ? qMax(cell_reach, neighbor_list_reach) : cell_reach;
+    }
+    void build_neighbor_list(float influence_radius);
+    void update_neighbor_list_reach();
+    void find_neighbors(int start_particle, int end_particle, float cutoff, bool count_only);
+    int cell_id_from_world_pos(QPointF pos) const;
+    void update_cell_sizes();
+    void reset_cells();
+    int get_nb_cell_ids() const;
+    void update_traversal_order();
+    void update_auto_tuning();
+    void update_quadtrees();
+    void build_quadtree(int index, int thread);
+    void build_quadtree_node(int node, int& next_node, int first, const int* square_start, int first_square, int nb_squares);
+    void update_columns();
+    void update_chunks(int nb_chunks);
+    void update_chunk_dependencies(int nb_chunks);
+    void reorder_particles();
+    void check_allocations(long long allocations);
+
+    struct Cell {
+        // The indices of the particles of a cell, in the sorted index array
+        const int* first;
+        const int* last;
+        const int* begin() const {return first;}
+        const int* end() const {return last;}
+    };
+
+    inline Cell get_cell(int id) const {
+        return {sorted_particles.data() + cell_start[id], sorted_particles.data() + cell_start[id + 1]};
+    }
+
+    inline Cell get_cells(int first_id, int last_id) const {
+        // The particles of consecutive cells (eg: three cells of a row) are contiguous in the sorted index array
+        return {sorted_particles.data() + cell_start[first_id], sorted_particles.data() + cell_start[last_id + 1]};
+    }
+
+    struct QuadtreeNode {
+        // A square of a crowded cell: the range of its particles in the sorted index array, and the bounding box of their
+        // predicted positions. The 4 children of a node are consecutive nodes (-1: the node is a leaf).
+        int first;
+        int last;
+        int children;
+        float min_x;
+        float min_y;
+        float max_x;
+        float max_y;
+    };
+
+    static constexpr int max_cell_reach = 2; // the smallest cells are half an influence radius wide
+    static constexpr int max_cell_ranges = 4; // the most ranges add_cell_ranges gives for a cell
+    static constexpr int max_neighbor_ranges = (2 * max_cell_reach + 1) * (2 * max_cell_reach + 1) * max_cell_ranges;
+    static constexpr int max_forward_ranges = (1 + max_cell_reach * (2 * max_cell_reach + 2)) * max_cell_ranges;
+
+    inline void add_cell_ranges(int cell, float x, float y, float radius, Cell* ranges, int& nb_ranges) const {
+        // Adds the particles of the cell that may be within radius of the world position to ranges. For a crowded cell, these
+        // are the leaves of its quadtree whose bounding box is within radius (with a margin for the rounding), the consecutive
+        // ones being merged. Once the cell has max_cell_ranges ranges, the last one is extended instead: it then also covers
+        // particles out of reach, which the caller tests anyway.
+        const int root = crowded_cells.empty() ? -1 : cell_quadtrees[cell];
+        if (root < 0) {
+            ranges[nb_ranges++] = get_cell(cell);
+            return;
+        }
+
+        const float squared_radius = radius * radius * 1.001f;
+        const int first_range = nb_ranges;
+        int stack[16];
+        int stack_size = 0;
+        stack[stack_size++] = root;
+        while (stack_size > 0) {
+            const QuadtreeNode& node = quadtree_nodes[stack[--stack_size]];
+            const float dx = qMax(qMax(node.min_x - x, x - node.max_x), 0.f);
+            const float dy = qMax(qMax(node.min_y - y, y - node.max_y), 0.f);
+            if (node.first == node.last || dx * dx + dy * dy > squared_radius) continue;
+
+            if (node.children >= 0) {
+                // the children are visited in order, so that the ranges follow the sorted index array
+                for (int k = 3; k >= 0; k--) {
+                    stack[stack_size++] = node.children + k;
+                }
+                continue;
+            }
 
-    QVector<QPoint> get_neighbor_cells(QPoint pos);
+            const int* first = sorted_particles.data() + node.first;
+            const int* last = sorted_particles.data() + node.last;
+            if (nb_ranges > first_range && (ranges[nb_ranges - 1].last == first || nb_ranges - first_range == max_cell_ranges)) {
+                ranges[nb_ranges - 1].last = last;
+            }
+            else {
+                ranges[nb_ranges++] = {first, last};
+            }
+        }
+    }
+
+    inline int cell_id_from_grid_pos(QPoint pos) const {
+        // Returns the id of the cell at the given position in the grid (eg: third cell from left, first from bottom), the
+        // ghost cells being at -cell_reach to -1 and nb_cells to nb_cells + cell_reach - 1. With the hashed storage, returns
+        // -1 if the cell has no id.
+        if (cell_storage == CellStorage::hashed) return hashed_cells.find(pos);
+        return (pos.y() + cell_reach) * padded_width + pos.x() + cell_reach;
+    }
 
-    QVector<QPoint> get_neighbor_cells(int id) {
-        return get_neighbor_cells(grid_pos_from_cell_id(id));
+    inline QPoint grid_pos_from_cell_id(int id) const {
+        if (cell_storage == CellStorage::hashed) return hashed_cells.get_pos(id);
+        return {id % padded_width - cell_reach, id / padded_width - cell_reach};
     }
 
-    inline int cell_id_from_grid_pos(QPoint pos) {
-        // Returns the id of the cell at the given position in the grid (eg: third cell from left, first from bottom)
-        return pos.y() * nb_cells.x() + pos.x();
+    inline QPoint grid_pos_from_world_pos(QPointF pos) const {
+        // Returns the position in the grid of the cell containing the world position (never a ghost cell)
+        return {qBound(0, int(pos.x() * inverse_cell_width), nb_cells.x() - 1),
+                qBound(0, int(pos.y() * inverse_cell_height), nb_cells.y() - 1)};
     }
 
-    inline QPoint grid_pos_from_cell_id(int id) {
-        return {id % nb_cells.x(), id / nb_cells.x()};
+    template<typename Function>
+    void for_each_cell_around(int cell, const Function& function) const {
+        // Calls function on the id of each cell of the stencil around the cell (including itself) that has one
+        if (cell_storage == CellStorage::dense) {
+            for (int dy = -cell_reach; dy <= cell_reach; dy++) {
+                const int row = cell + dy * padded_width;
+                for (int n = row - cell_reach; n <= row + cell_reach; n++) {
+                    function(n);
+                }
+            }
+            return;
+        }
+
+        const QPoint pos = hashed_cells.get_pos(cell);
+        for (int dy = -cell_reach; dy <= cell_reach; dy++) {
+            for (int dx = -cell_reach; dx <= cell_reach; dx++) {
+                const int n = hashed_cells.find({pos.x() + dx, pos.y() + dy});
+                if (n >= 0) function(n);
+            }
+        }
+    }
+
+    inline bool narrow_row(int row, float x, float y, float radius, int& first_column, int& last_column) const {
+        // With cells smaller than the influence radius, narrows [first_column, last_column] to the cells of the row that the
+        // circle touches (with a margin for the rounding), and returns false if it touches none
+        if (cell_reach == 1) return true;
+        const float row_distance = qMax(qMax(row / inverse_cell_height - y, y - (row + 1) / inverse_cell_height), 0.f);
+        const float squared_half_width = radius * radius * 1.001f - row_distance * row_distance;
+        if (squared_half_width <= 0) return false;
+        const float half_width = qSqrt(squared_half_width);
+        first_column = qMax(first_column, qFloor((x - half_width) * inverse_cell_width));
+        last_column = qMin(last_column, qFloor((x + half_width) * inverse_cell_width));
+        return first_column <= last_column;
+    }
+
+    inline int get_neighbor_cells(float x, float y, float radius, Cell* cells) const {
+        // Writes the particles of the stencil around the world position that may be within radius of it in cells, as ranges,
+        // and returns their number. With the dense storage and no crowded cell, each row of cells is one contiguous range.
+        // The caller then loops over the ranges whatever the storage, so that its loop body is only compiled once.
+        const QPoint pos = grid_pos_from_world_pos(QPointF(x, y));
+        const bool row_ranges = cell_storage == CellStorage::dense && crowded_cells.empty();
+        int nb_ranges = 0;
+        for (int row = pos.y() - cell_reach; row <= pos.y() + cell_reach; row++) {
+            int first_column = pos.x() - cell_reach;
+            int last_column = pos.x() + cell_reach;
+            if (!narrow_row(row, x, y, radius, first_column, last_column)) continue;
+
+            if (row_ranges) {
+                const int first_cell = cell_id_from_grid_pos({first_column, row});
+                cells[nb_ranges++] = get_cells(first_cell, first_cell + last_column - first_column);
+                continue;
+            }
+            for (int column = first_column; column <= last_column; column++) {
+                const int cell = cell_id_from_grid_pos({column, row});
+                if (cell >= 0) add_cell_ranges(cell, x, y, radius, cells, nb_ranges);
+            }
+        }
+        return nb_ranges;
     }
 
-    pair<float, float> calculate_density(const shared_ptr<Particle>& particle);
-    pair<float, float> density_to_pressure(float density, float near_density);
-    QVector2D calculate_pressure_force(const shared_ptr<Particle>& particle);
-    QVector2D calculate_viscosity_force(const shared_ptr<Particle>& particle);
+    template<typename Function>
+    void for_each_particle_in_neighbor_cells(float x, float y, float radius, const Function& function) {
+        // Calls function on each particle of the cells around the world position that may be within radius of it
+        Cell cells[max_neighbor_ranges];
+        const int nb_ranges = get_neighbor_cells(x, y, radius, cells);
+        for (int k = 0; k < nb_ranges; k++) {
+            for (int j : cells[k]) {
+                function(j);
+            }
+        }
+    }
+
+    template<typename Function>
+    void for_each_particle_in_cells_within(float x, float y, float radius, const Function& function) {
+        // Calls function on each particle of the cells that the circle around the world position touches, however many
+        // cells it spans: unlike the stencil of for_each_particle_in_neighbor_cells, which reaches one influence radius, it
+        // serves the neighbor lists, which reach the influence radius plus the skin
+        const QPoint first = grid_pos_from_world_pos(QPointF(x - radius, y - radius));
+        const QPoint last = grid_pos_from_world_pos(QPointF(x + radius, y + radius));
+        for (int row = first.y(); row <= last.y(); row++) {
+            int first_column = first.x();
+            int last_column = last.x();
+            if (!narrow_row(row, x, y, radius, first_column, last_column)) continue;
+
+            for (int column = first_column; column <= last_column; column++) {
+                const int cell = cell_id_from_grid_pos({column, row});
+                if (cell < 0) continue;
+                Cell ranges[max_cell_ranges];
+                int nb_ranges = 0;
+                add_cell_ranges(cell, x, y, radius, ranges, nb_ranges);
+                for (int k = 0; k < nb_ranges; k++) {
+                    for (int j : ranges[k]) {
+                        function(j);
+                    }
+                }
+            }
+        }
+    }
+
+    template<typename Function>
+    void for_each_forward_neighbor(int i, float x, float y, float radius, const Function& function) {
+        // Calls function on each particle that may be within radius of particle i, and that comes after it in
+        // the (cell, particle) order: the particles of the same cell with a greater id, and the particles of the half stencil
+        // (the cells on the right in the same row, and the rows above: 4 cells with cells of one influence radius). So each
+        // pair of neighbors is visited once.
+        const int cell = particle_cells[i];
+        if (neighbor_list_skin > 0) {
+            for (int j : neighbor_list.get_neighbors(i)) {
+                if (particle_cells[j] > cell || (particle_cells[j] == cell && j > i)) function(j);
+            }
+            return;
+        }
+
+        // the ranges of the cell itself come first, and only its particles with a greater id are visited
+        Cell cells[max_forward_ranges];
+        int nb_ranges = 0;
+        add_cell_ranges(cell, x, y, radius, cells, nb_ranges);
+        const int nb_own_ranges = nb_ranges;
+
+        const QPoint pos = grid_pos_from_cell_id(cell);
+        const bool row_ranges = cell_storage == CellStorage::dense && crowded_cells.empty();
+        for (int row = pos.y(); row <= pos.y() + cell_reach; row++) {
+            int first_column = row == pos.y() ? pos.x() + 1 : pos.x() - cell_reach;
+            int last_column = pos.x() + cell_reach;
+            if (!narrow_row(row, x, y, radius, first_column, last_column)) continue;
+
+            if (row_ranges) {
+                const int first_cell = cell_id_from_grid_pos({first_column, row});
+                cells[nb_ranges++] = get_cells(first_cell, first_cell + last_column - first_column);
+                continue;
+            }
+            for (int column = first_column; column <= last_column; column++) {
+                const int neighbor = cell_id_from_grid_pos({column, row});
+                if (neighbor >= 0) add_cell_ranges(neighbor, x, y, radius, cells, nb_ranges);
+            }
+        }
+
+        for (int k = 0; k < nb_ranges; k++) {
+            for (int j : cells[k]) {
+                if (k >= nb_own_ranges || j > i) function(j);
+            }
+        }
+    }
+
+    template<typename Function>
+    void for_each_cell_of_chunk(int chunk, const Function& function) {
+        // Calls function on each occupied cell of the chunk, in the traversal order: tile by tile, and row by row within a
+        // tile, so that the neighbors read for a row are still in the cache for the next one. While a cell is processed, the
+        // particles of the next one are prefetched. The time spent on each cell is added to its cost, used to balance the next step.
+        const int end_index = chunk_start[chunk + 1];
+        for (int i = chunk_start[chunk]; i < end_index; i++) {
+            const int cell = occupied_cells[i];
+            if (i + 1 < end_index) prefetch_cell(occupied_cells[i + 1]);
+            const auto start_time = std::chrono::steady_clock::now();
+            function(cell);
+            cell_costs[cell] += std::chrono::duration<float>(std::chrono::steady_clock::now() - start_time).count();
+        }
+    }
+
+    inline void prefetch_cell(int cell) {
+        const int p = sorted_particles[cell_start[cell]];
+        prefetch(&sorted_particles[cell_start[cell + 1] - 1]);
+        prefetch(&data.px[p]);
+        prefetch(&data.py[p]);
+        prefetch(&data.vx[p]);
+        prefetch(&data.vy[p]);
+    }
+
+    static inline void prefetch(const void* address) {
+#if defined(__GNUC__) || defined(__clang__)
+        __builtin_prefetch(address);
+#elif defined(FLOATBATCH_SSE2)
+        _mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#endif
+    }
+
+    template<typename Function>
+    void for_each_column_by_color(const Function& function) {
+        // Calls function on each column of cells, in 2 * reach + 1 phases: with cells of one influence radius, the
+        // columns whose x % 3 is 0, then 1, then 2. The pairs found from a column only involve particles of the columns
+        // x - reach to x + reach, so the columns of a phase never write the same particles, and each particle receives its
+        // contributions in the same order whatever the number of threads. The reach is cell_reach, or the reach of the
+        // neighbor lists, which can be further.
+        const int reach = get_neighbor_reach();
+        const int nb_colors = 2 * reach + 1;
+        for (int color = 0; color < nb_colors; color++) {
+            thread_pool->parallel_for((nb_cells.x() - color + nb_colors - 1) / nb_colors, [&](int task, int) {
+                function(color + nb_colors * task);
+            });
+        }
+    }
+
+    template<typename Function>
+    void for_each_neighbor(int i, float x, float y, float radius, const Function& function) {
+        // Calls function on each particle that may be within radius of particle i, at position (x, y)
+        if (neighbor_list_skin > 0) {
+            for (int j : neighbor_list.get_neighbors(i)) {
+                function(j);
+            }
+        }
+        else {
+            for_each_particle_in_neighbor_cells(x, y, radius, function);
+        }
+    }
+
+    struct PairBuffer {
+        // The neighbors closer than the influence radius, recorded by a task of the density pass for the force passes.
+        // The fields are stored in separate arrays so that the force passes load them by batches of FloatBatch::size pairs.
+        std::vector<int> j;
+        std::vector<float> dir_x; // unit direction to the neighbor
+        std::vector<float> dir_y;
+        std::vector<float> slope; // density kernel derivative
+        std::vector<float> viscosity_influence;
+
+        int size() const {return int(j.size());}
+        int capacity() const {return int(j.capacity());}
+        void clear() {j.clear(); dir_x.clear(); dir_y.clear(); slope.clear(); viscosity_influence.clear();}
+        void reserve(int capacity) {
+            j.reserve(capacity);
+            dir_x.reserve(capacity);
+            dir_y.reserve(capacity);
+            slope.reserve(capacity);
+            viscosity_influence.reserve(capacity);
+        }
+        void add(int _j, float _dir_x, float _dir_y, float _slope, float _viscosity_influence) {
+            j.push_back(_j);
+            dir_x.push_back(_dir_x);
+            dir_y.push_back(_dir_y);
+            slope.push_back(_slope);
+            viscosity_influence.push_back(_viscosity_influence);
+        }
+    };
+
+    template<typename Kernels>
+    pair<float, float> calculate_density(int i, const Kernels& kernels, PairBuffer& pairs);
+    QVector2D calculate_pressure_force(int i);
+    QVector2D calculate_viscosity_force(int i);
 
 public:
     const QSizeF& world_size;
 
 private:
+    QPoint influence_cells; // the size of the grid in cells of one influence radius, given by the particle system
+    int cell_reach = 1; // the cells are 1 / cell_reach influence radius wide, and the stencil reaches cell_reach cells around
     QPoint nb_cells;
-    QVector<QVector<shared_ptr<Particle>>> particles; //an array containing the cells of the grid, containing pointers to the particles
+    CellStorage cell_storage;
+    CellHashTable hashed_cells; // the ids of the cells, with the hashed storage
+    int padded_width; // nb_cells.x() + 2 * cell_reach, with the ghost cells
+    float inverse_cell_width; // calculated when the grid changes, so that finding a particle's cell needs no division
+    float inverse_cell_height;
+    long long current_step = 0; // the number of steps since the grid was created, which dates the states of the cells
+
+    // Every reorder_interval steps (0: never), the particles' slots are renumbered in the traversal order of their cells, so
+    // that the particles of neighboring cells stay close in memory while they move
+    int reorder_interval = 100;
+    int steps_since_reorder = 0;
+    std::vector<int> reorder_order;
+
+    // The full engine's passes traverse the occupied cells by tiles of cells, in Z-order. The occupied cells are split in many
+    // more chunks than threads, with about the same cost each, so that the threads that finish early can steal chunks from
+    // the others. The cost of a cell is its time measured at the previous step, or its number of particles when the cells
+    // weren't measured.
+    std::vector<float> cell_costs;
+    std::vector<int> chunk_start; // the chunk c is made of the cells occupied_cells[chunk_start[c]] to ...[chunk_start[c + 1] - 1]
+    int chunks_per_thread = 8;
+    int max_chunk_particles = 0; // the most particles in a chunk, which sizes the pair buffers
 
-    shared_ptr<float> g;
-    shared_ptr<float> collision_damping;
-    shared_ptr<float> fluid_density;
-    shared_ptr<float> pressure_multiplier;
-    shared_ptr<float> near_pressure_multiplier;
-    shared_ptr<float> viscosity_multiplier;
+    // The symmetric engine's passes traverse the occupied cells by columns, from bottom to top: the cells of column x are
+    // column_cells[column_start[x]] to column_cells[column_start[x + 1] - 1]
+    std::vector<int> column_start;
+    std::vector<int> column_cells;
+    int max_column_particles = 0; // the most particles that a column held so far, which sizes the pair buffers
 
-    QRandomGenerator random; // used to give random directions to particles that end up at the same position
+    // The task graph of the densities and forces: the force chunks that need the densities of chunk c are
+    // dependents[dependent_start[c]] to dependents[dependent_start[c + 1] - 1], and a force chunk can start when its count of
+    // remaining dependencies reaches 0
+    std::vector<int> dependent_start;
+    std::vector<int> dependents;
+    std::vector<std::atomic<int>> remaining_dependencies;
+    std::vector<int> dependency_marks; // the last force chunk that listed each density chunk, to list it once
+    std::vector<int> dependency_offsets;
+
+    ParticleData data; // the particles' physical state
+
+    // The particles sorted by cell: the particles of cell c are sorted_particles[cell_start[c]] to sorted_particles[cell_start[c + 1] - 1]
+    std::vector<int> sorted_particles;
+    std::vector<int> cell_start;
+    std::vector<int> particle_cells; // the cell id of each particle, computed when sorting
+    std::vector<int> occupied_cells; // the cells that contain particles, in the traversal order
+    std::vector<quint64> occupied_ranks; // their ranks in the traversal order (see traversal_rank)
+    std::vector<pair<quint64, int>> ranked_cells; // the occupied cells being sorted by rank
+    // For each sorting task, the number of its particles in each cell, then where to write them. Only the entries of the
+    // occupied cells are used, and they are reset to 0 after the sort, so that the empty cells are never visited.
+    std::vector<std::vector<int>> cell_offsets;
+    std::vector<std::vector<int>> task_new_cells; // for each sorting task, the cells where it counted its first particle
+    std::vector<std::vector<int>> task_new_cell_particles; // for each sorting task, its particles whose cell had no id (hashed storage)
+
+    // The cells with more particles than crowded_cell_size are subdivided in a quadtree, so that the neighbor searches only
+    // test the particles of the nodes within reach instead of the whole cell (see build_quadtree)
+    std::vector<int> crowded_cells;
+    std::vector<int> cell_quadtrees; // the root of each cell's quadtree in quadtree_nodes, or -1
+    std::vector<QuadtreeNode> quadtree_nodes;
+    std::vector<std::vector<int>> thread_quadtree_buffers; // for each thread, the particles of the cell it subdivides
+
+    // With the symmetric engine, each pair of neighbors is visited once, and its forces are applied to both particles
+    // (equal and opposite), instead of being calculated once from each particle.
+    bool symmetric_forces = false;
+    std::vector<float> pair_force_x; // the pressure and viscosity accelerations accumulated by the symmetric engine
+    std::vector<float> pair_force_y;
+
+    NeighborList neighbor_list;
+    float neighbor_list_skin = 0; // when it is 0, the neighbor lists are not used, and the neighbors are found in the cells at each pass
+    bool neighbor_list_invalid = true; // when particles were added or the grid was changed since the list was built
+    // The most cells, along a row or a column, between the cells of the two particles of a pair of the lists (which reach
+    // the influence radius plus the skin), measured when they are built, and when the cells change in a block frame
+    int neighbor_list_reach = 0;
+    std::vector<float> task_results; // a value calculated by each task of a parallel for (eg: maximum)
+
+    // The time step control of update_particles_for: the steps are short enough for the fastest particle to move less than
+    // cfl_factor influence radius (CFL condition), and for the largest acceleration a to satisfy dt < force_factor * sqrt(h / a).
+    // The speeds and accelerations are the ones of the last step, measured by the force pass. A factor of 0 disables its criterion.
+    float cfl_factor = 0.4;
+    float force_factor = 0.25;
+    float max_speed = 0;
+    float max_acceleration = 0;
+    std::vector<float> task_max_speed; // squared, for each task of the force pass
+    std::vector<float> task_max_acceleration;
+
+    // With the block time steps, update_particles_for splits a frame in 2^nb_block_levels fine steps, and each particle has a
+    // level l: it is only kicked (its forces calculated and its speed updated for the whole block) at the first of each block
+    // of 2^(nb_block_levels - l) fine steps, while all the particles drift (move at their speed) at each fine step, so that
+    // their positions stay synchronized. The level of a particle is chosen at the beginning of its blocks, from its own speed
+    // and acceleration, so the resting fluid is kicked once per frame while the fast particles are kicked at each fine step.
+    // The densities are only calculated in the cells around the active particles, whose forces need them.
+    bool block_time_steps = false;
+    bool in_block_frame = false;
+    int nb_block_levels = 0;
+    int block_step = 0; // the current fine step of the frame
+    float block_duration = 0; // the duration of the frame, ie of a level 0 block
+    std::vector<int> particle_levels;
+    std::vector<char> particle_active; // whether the particle starts a block at the current fine step
+    std::vector<long long> cell_active_steps; // the last step when the cell had an active particle
+
+    // The cells whose particles stayed slower than sleep_speed, with an acceleration below sleep_acceleration, during sleep_steps
+    // steps (0: never) are put to sleep: their particles are stopped, and the passes skip them, so that their densities and
+    // pressures are frozen. A sleeping cell wakes up when a neighbor cell moves, or when the user interacts around it, and
+    // all the cells wake up when the physical parameters change. The cells only sleep with the full engine.
+    float sleep_speed = 0.05;
+    float sleep_acceleration = 0.5;
+    int sleep_steps = 0;
+    // (a sleeping cell stays occupied, since its particles don't move)
+    bool cells_can_sleep = false;
+    std::vector<char> sleeping_cells;
+    std::vector<long long> cell_move_steps; // the last step when the cell moved
+    std::vector<long long> cell_calm_since; // the cell has been calm for current_step - cell_calm_since[c] steps
+    std::vector<long long> cell_occupied_steps; // the last step when the cell was occupied
+
+    // The steps after a change (particles added, grid, threads or parameters changed...) may allocate; the following ones
+    // must not, so the buffers that follow the fluid are sized with a margin during the warm-up (see allocationcheck.h)
+    int steps_since_change = 0;
+    int last_nb_threads = 0;
+
+    // The neighbor pairs of the current step. Each task of the density pass writes the pairs of its particles in its own buffer
+    // (with the symmetric engine, there is one buffer per column, and a particle only has the pairs of its forward neighbors).
+    // The pairs of particle i are pair_start[i] to pair_end[i] - 1 in pair_buffers[pair_buffer_ids[i]]. They are padded
+    // to a multiple of FloatBatch::size with pairs to the particle itself that have no influence.
+    std::vector<PairBuffer> pair_buffers;
+    float pairs_per_particle = 0; // the pairs (with the padding) of a particle at the last step, on average
+    std::vector<int> pair_buffer_ids;
+    std::vector<int> pair_start;
+    std::vector<int> pair_end;
+
+    // The kernels used by the density pass. The coefficients of each set are calculated when the influence radius changes.
+    SmoothingKernel smoothing_kernel = SmoothingKernel::spiky;
+    SpikyKernels spiky_kernels;
+    WendlandC2Kernels wendland_c2_kernels;
+    CubicSplineKernels cubic_spline_kernels;
+
+    shared_ptr<SimParamsChannel> params_channel; // the parameters published by the ui
+    SimParams params; // the parameters of the current step, read from the channel at its beginning
+
+    shared_ptr<ThreadPool> thread_pool; // the worker threads, shared with the next grids of the particle system
+
+    // The auto-tuner chooses the number of threads, the size of the cells and the number of chunks per thread by measuring
+    // the frames, at the start and when the particles or the influence radius change a lot
+    AutoTuning auto_tuning = AutoTuning::off;
+    AutoTuner auto_tuner;
+    int max_threads; // the cores available to the process (see count_available_cores): the most threads the tuning tries
 };
 
-// These four functions are used to calculate the density
-float density_smoothing_kernel(float influence_radius, float distance);
-float density_smoothing_kernel_derivative(float influence_radius, float distance);
-float near_density_smoothing_kernel(float influence_radius, float distance);
-float near_density_smoothing_kernel_derivative(float influence_radius, float distance);
+// Gives a direction to two particles (identified by their ids) that end up at the same position
+QVector2D separation_direction(int i, int j);
+
+// The position of a cell along the Z-order curve
+quint32 morton_code(int x, int y);
+
+// The rank of a cell in the traversal order of the passes: by tiles of cells in Z-order, and row by row within a tile
+quint64 traversal_rank(QPoint pos);
 
-// This function is used to calculate the viscosity
-float viscosity_smoothing_kernel(float influence_radius, float distance);
 
 #endif // GRID_H
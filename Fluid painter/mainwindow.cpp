@@ -4,6 +4,7 @@
 #include <QFileDialog>
 #include "mainwindow.h"
 #include "ui_mainwindow.h"
+#include "availablecores.h"
 
 #include <QDebug>
 
@@ -21,10 +22,15 @@ inline constexpr float init_collision_damping = 0.15;
 inline constexpr float init_particle_radius = 0.03;
 inline constexpr float init_particle_influence_radius = 0.25;
 inline const QColor init_default_color = Qt::white;
+inline constexpr CellStorage cell_storage = CellStorage::dense; // hashed: the memory of the grid follows the particles instead of the world
+inline constexpr int cores_check_interval = 1000; // the ms between two checks of the cores available (a container's CPU quota can change)
 
 MainWindow::MainWindow(QWidget *parent) : QMainWindow(parent), ui(new Ui::MainWindow)
 {
     ui->setupUi(this);
+    // The simulation is deterministic whatever the number of threads, so the preview and the render match. The threads are
+    // sized after the cores the process may use (its affinity and its container's CPU quota), not the machine's
+    const int nb_threads = count_available_cores();
     particle_system = new ParticleSystem(init_nb_particles,
                                          init_particle_radius,
                                          init_particle_influence_radius,
@@ -38,6 +44,8 @@ MainWindow::MainWindow(QWidget *parent) : QMainWindow(parent), ui(new Ui::MainWi
                                          init_near_pressure_multiplier,
                                          init_viscosity_multiplier,
                                          init_default_color,
+                                         nb_threads,
+                                         cell_storage,
                                          this);
 
     ui->mainLayout->addWidget(particle_system);
@@ -88,6 +96,11 @@ MainWindow::MainWindow(QWidget *parent) : QMainWindow(parent), ui(new Ui::MainWi
     auto timer = new QTimer(parent);
     QObject::connect(timer, SIGNAL(timeout()), particle_system, SLOT(update_view()));
     timer->start(2);
+
+    auto cores_timer = new QTimer(this);
+    QObject::connect(cores_timer, SIGNAL(timeout()), this, SLOT(update_available_cores()));
+    cores_timer->start(cores_check_interval);
+    update_available_cores();
 }
 
 void MainWindow::set_nb_particles(int val) {
@@ -201,6 +214,13 @@ void MainWindow::set_image() {
     particle_system->set_image(filename);
 }
 
+void MainWindow::update_available_cores() {
+    // Follows the cores the process may use, and shows how many threads the simulation runs on
+    particle_system->update_available_cores();
+    ui->statusbar->showMessage(QString("%1 threads, %2 available cores").arg(particle_system->get_nb_threads())
+                                                                        .arg(particle_system->get_available_cores()));
+}
+
 MainWindow::~MainWindow()
 {
     delete ui;
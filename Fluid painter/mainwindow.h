@@ -31,6 +31,7 @@ public slots:
     void start_animation();
     void animation_done();
     void set_image();
+    void update_available_cores();
 
 private:
     Ui::MainWindow* ui;
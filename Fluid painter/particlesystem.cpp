@@ -5,6 +5,7 @@
 #include <QFile>
 #include "qpainter.h"
 #include "particlesystem.h"
+#include "availablecores.h"
 
 #include <QDebug>
 
@@ -14,6 +15,10 @@ inline constexpr float image_default_scale = 0.75;
 inline const QColor image_rec_color = QColor(255, 255, 255, 100);
 inline const QColor image_rec_border_color = Qt::white;
 inline constexpr float image_rec_border_thickness = 5;
+inline constexpr float sleep_speed = 0.1; // the cells whose particles stay slower than this,
+inline constexpr float sleep_acceleration = 2.0; // with a smaller acceleration than this,
+inline constexpr int sleep_steps = 30; // during this many steps (0: never) are put to sleep until a neighbor cell moves
+inline constexpr AutoTuning auto_tuning = AutoTuning::threads_and_chunks; // not the cell size, which changes the results
 
 using std::make_shared;
 using std::shared_ptr;
@@ -22,32 +27,30 @@ using std::make_unique;
 ParticleSystem::ParticleSystem(int _nb_particles, float _particle_radius, float _particle_influence_radius, const QSize& _im_size,
                                QSizeF _world_size, float _time_step, float _g, float _collision_damping, float _fluid_density,
                                float _pressure_multiplier, float _near_pressure_multiplier, float _viscosity_multiplier,
-                               QColor _particle_default_color, QWidget *parent) :
+                               QColor _particle_default_color, int _nb_threads, CellStorage _cell_storage, QWidget *parent) :
          QOpenGLWidget(parent), nb_particles(_nb_particles), time_step(_time_step),
-         im_size(_im_size), world_size(_world_size), particle_default_color(_particle_default_color)
+         im_size(_im_size), world_size(_world_size), available_cores(_nb_threads), cell_storage(_cell_storage),
+         particle_default_color(_particle_default_color)
 {
-    particle_radius = make_shared<float>(_particle_radius);
-    particle_influence_radius = make_shared<float>(_particle_influence_radius);
-    g = make_shared<float>(_g);
-    collision_damping = make_shared<float>(_collision_damping);
-    fluid_density = make_shared<float>(_fluid_density);
-    pressure_multiplier = make_shared<float>(_pressure_multiplier);
-    near_pressure_multiplier = make_shared<float>(_near_pressure_multiplier);
-    viscosity_multiplier = make_shared<float>(_viscosity_multiplier);
+    params = {_particle_radius, _particle_influence_radius, _g, _collision_damping, _fluid_density,
+              _pressure_multiplier, _near_pressure_multiplier, _viscosity_multiplier};
+    params_channel = make_shared<SimParamsChannel>(params);
 
     this->setMinimumSize(im_size.width(), im_size.height());
 
+    thread_pool = make_shared<ThreadPool>(_nb_threads);
+
     particles = QVector<shared_ptr<Particle>>();
 
-    grid = make_shared<Grid>(QPoint(world_size.width() / *particle_influence_radius,
-                                    world_size.height() / *particle_influence_radius),
+    grid = make_shared<Grid>(QPoint(world_size.width() / params.influence_radius,
+                                    world_size.height() / params.influence_radius),
                              world_size,
-                             g,
-                             collision_damping,
-                             fluid_density,
-                             pressure_multiplier,
-                             near_pressure_multiplier,
-                             viscosity_multiplier);
+                             params_channel,
+                             thread_pool,
+                             cell_storage);
+    grid->set_sleep_thresholds(sleep_speed, sleep_acceleration, sleep_steps);
+    grid->set_auto_tuning(auto_tuning);
+    grid->set_max_threads(available_cores);
 
     colors = QVector<QColor>(nb_particles, particle_default_color);
 }
@@ -67,11 +70,11 @@ void ParticleSystem::update_view() {
 
 void ParticleSystem::update_physics() {
     if (end_frame == -1 || frame < end_frame) {
-        if (particles.size() < nb_particles && frame % int(particles_init_speed * *particle_influence_radius) == 0) {
+        if (particles.size() < nb_particles && frame % int(particles_init_speed * params.influence_radius) == 0) {
             create_particles();
         }
 
-        grid->update_particles(time_step);
+        grid->update_particles_for(time_step);
         update();
 
         frame++;
@@ -103,39 +106,41 @@ void ParticleSystem::start_animation() {
 
 void ParticleSystem::create_particles() {
     // Creates several particles on both sides of the screen, at the top
-    int n = (world_size.height() / 10.0) / (particles_init_spacing * *particle_radius);
+    int n = (world_size.height() / 10.0) / (particles_init_spacing * params.particle_radius);
 
     for (int j = 0; j < n && particles.size() <= nb_particles - 2; j++) {
-        shared_ptr<Particle> particle_left = make_shared<Particle>(particle_radius, particle_influence_radius,
-                                                              QPointF(*particle_radius, world_size.height() - (j + 1) * (particles_init_spacing * *particle_radius)),
-                                                              QVector2D(particles_init_speed, 0.0),
-                                                              colors.at(particles.size()), grid);
-        grid->add_particle(particle_left);
-        particles.append(particle_left);
-
-        shared_ptr<Particle> particle_right = make_shared<Particle>(particle_radius, particle_influence_radius,
-                                                              QPointF(world_size.width() - *particle_radius, world_size.height() - (j + 1) * (particles_init_spacing * *particle_radius)),
-                                                              QVector2D(-particles_init_speed, 0.0),
-                                                              colors.at(particles.size()), grid);
-
-        grid->add_particle(particle_right);
-        particles.append(particle_right);
+        int id_left = grid->add_particle(QPointF(params.particle_radius, world_size.height() - (j + 1) * (particles_init_spacing * params.particle_radius)),
+                                         QVector2D(particles_init_speed, 0.0));
+        particles.append(make_shared<Particle>(id_left, colors.at(id_left), grid));
+
+        int id_right = grid->add_particle(QPointF(world_size.width() - params.particle_radius, world_size.height() - (j + 1) * (particles_init_spacing * params.particle_radius)),
+                                          QVector2D(-particles_init_speed, 0.0));
+        particles.append(make_shared<Particle>(id_right, colors.at(id_right), grid));
     }
 }
 
+void ParticleSystem::update_available_cores() {
+    // Checks the cores the process may use again, since the CPU quota of its container or its affinity may have changed,
+    // and gives them to the grid
+    const int nb_cores = count_available_cores();
+    if (nb_cores == available_cores) return;
+    available_cores = nb_cores;
+    grid->set_max_threads(available_cores);
+}
+
 void ParticleSystem::reset_particles() {
     // Resets the particles and the grid
     particles = QVector<shared_ptr<Particle>>();
 
-    grid = make_shared<Grid>(QPoint(world_size.width() / *particle_influence_radius,
-                                    world_size.height() / *particle_influence_radius),
+    grid = make_shared<Grid>(QPoint(world_size.width() / params.influence_radius,
+                                    world_size.height() / params.influence_radius),
                              world_size,
-                             g,
-                             collision_damping,
-                             fluid_density,
-                             pressure_multiplier,
-                             near_pressure_multiplier,
-                             viscosity_multiplier);
+                             params_channel,
+                             thread_pool,
+                             cell_storage);
+    grid->set_sleep_thresholds(sleep_speed, sleep_acceleration, sleep_steps);
+    grid->set_auto_tuning(auto_tuning);
+    grid->set_max_threads(available_cores);
 }
 
 void ParticleSystem::reset_colors_and_image() {
@@ -144,9 +149,10 @@ void ParticleSystem::reset_colors_and_image() {
 }
 
 void ParticleSystem::set_particles_influence_radius(float _particle_influence_radius) {
-    *particle_influence_radius = _particle_influence_radius;
-    grid->change_grid(QPoint(world_size.width() / *particle_influence_radius,
-                             world_size.height() / *particle_influence_radius));
+    params.influence_radius = _particle_influence_radius;
+    params_channel->publish(params);
+    grid->change_grid(QPoint(world_size.width() / params.influence_radius,
+                             world_size.height() / params.influence_radius));
 }
 
 void ParticleSystem::set_image(QString filename) {
@@ -214,7 +220,7 @@ void ParticleSystem::paintEvent(QPaintEvent* e) {
     }
 
     // draw the particles
-    int particle_draw_radius = *particle_radius * im_size.width() / world_size.width();
+    int particle_draw_radius = params.particle_radius * im_size.width() / world_size.width();
     for (auto particle : particles) {
         p.setPen(Qt::NoPen);
         p.setBrush(QBrush(particle->get_color()));
@@ -11,6 +11,9 @@
 #include <memory>
 #include "libqtavi/QAviWriter.h"
 #include "grid.h"
+#include "particle.h"
+#include "simparams.h"
+#include "threadpool.h"
 
 using std::shared_ptr;
 using std::unique_ptr;
@@ -26,7 +29,8 @@ public:
     explicit ParticleSystem(int _nb_particles, float _particle_radius, float _particle_influence_radius, const QSize& _im_size,
                                             QSizeF _world_size, float _time_step, float _g, float _collision_damping, float _fluid_density,
                                             float _pressure_multiplier, float _near_pressure_multiplier, float _viscosity_multiplier,
-                                            QColor _particle_default_color, QWidget *parent = nullptr);
+                                            QColor _particle_default_color, int _nb_threads, CellStorage _cell_storage,
+                                            QWidget *parent = nullptr);
 
     void paintEvent(QPaintEvent* e) override;
     void mousePressEvent(QMouseEvent *event) override;
@@ -44,14 +48,18 @@ public:
 
     void set_nb_particles(int _nb_particles) {nb_particles = _nb_particles;
                                              colors = QVector<QColor>(nb_particles, particle_default_color);}
-    void set_particles_radius(float _particle_radius) {*particle_radius = _particle_radius;}
+    void set_particles_radius(float _particle_radius) {params.particle_radius = _particle_radius; params_channel->publish(params);}
     void set_particles_influence_radius(float _particle_influence_radius);
-    void set_g(float _g) {*g = _g;}
-    void set_fluid_density(float _fluid_density) {*fluid_density = _fluid_density;}
-    void set_pressure_multiplier(float _pressure_multiplier) {*pressure_multiplier = _pressure_multiplier;}
-    void set_near_pressure_multiplier(float _near_pressure_multiplier) {*near_pressure_multiplier = _near_pressure_multiplier;}
-    void set_viscosity_multiplier(float _viscosity_multiplier) {*viscosity_multiplier = _viscosity_multiplier;}
-    void set_collision_damping(float _collision_damping) {*collision_damping = _collision_damping;}
+    void set_g(float _g) {params.g = _g; params_channel->publish(params);}
+    void set_fluid_density(float _fluid_density) {params.fluid_density = _fluid_density; params_channel->publish(params);}
+    void set_pressure_multiplier(float _pressure_multiplier) {params.pressure_multiplier = _pressure_multiplier; params_channel->publish(params);}
+    void set_near_pressure_multiplier(float _near_pressure_multiplier) {params.near_pressure_multiplier = _near_pressure_multiplier; params_channel->publish(params);}
+    void set_viscosity_multiplier(float _viscosity_multiplier) {params.viscosity_multiplier = _viscosity_multiplier; params_channel->publish(params);}
+    void set_collision_damping(float _collision_damping) {params.collision_damping = _collision_damping; params_channel->publish(params);}
+
+    void update_available_cores();
+    int get_available_cores() const {return available_cores;}
+    int get_nb_threads() const {return thread_pool->get_nb_threads();}
 
     void update_physics();
 
@@ -80,18 +88,15 @@ private:
 
 private:
     int nb_particles;
-    shared_ptr<float> particle_radius;
-    shared_ptr<float> particle_influence_radius;
-    shared_ptr<float> g;
-    shared_ptr<float> collision_damping;
-    shared_ptr<float> fluid_density;
-    shared_ptr<float> pressure_multiplier;
-    shared_ptr<float> near_pressure_multiplier;
-    shared_ptr<float> viscosity_multiplier;
-    float time_step;
+    SimParams params; // the physical parameters set by the ui, published to the grid each time they change
+    shared_ptr<SimParamsChannel> params_channel;
+    float time_step; // the simulated time between two frames, which the grid splits in as many steps as needed
 
     QSize im_size;
     QSizeF world_size;
+    int available_cores; // the cores the process may use, checked again from time to time (see count_available_cores)
+    shared_ptr<ThreadPool> thread_pool;
+    CellStorage cell_storage; // kept to create the grid again when the particles are reset
     shared_ptr<Grid> grid;
     QVector<shared_ptr<Particle>> particles;
 
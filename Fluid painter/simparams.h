@@ -0,0 +1,52 @@
+#ifndef SIMPARAMS_H
+#define SIMPARAMS_H
+
+#include <atomic>
+
+struct SimParams
+{
+    /**
+      * The physical parameters of the simulation, which the user can change while it runs. Grid copies them at the
+      * beginning of each step, so they stay constant during a step.
+      */
+
+    float particle_radius;
+    float influence_radius;
+    float g;
+    float collision_damping;
+    float fluid_density;
+    float pressure_multiplier;
+    float near_pressure_multiplier;
+    float viscosity_multiplier;
+
+    bool operator==(const SimParams& other) const {
+        return particle_radius == other.particle_radius && influence_radius == other.influence_radius && g == other.g
+            && collision_damping == other.collision_damping && fluid_density == other.fluid_density
+            && pressure_multiplier == other.pressure_multiplier && near_pressure_multiplier == other.near_pressure_multiplier
+            && viscosity_multiplier == other.viscosity_multiplier;
+    }
+    bool operator!=(const SimParams& other) const {return !(*this == other);}
+};
+
+class SimParamsChannel
+{
+    /**
+      * This class passes the parameters from the ui to the simulation as a whole: publish writes a new version, and read
+      * returns a version that was published, never a mix of two of them. It is a seqlock: the sequence is odd while a
+      * version is being written, and read tries again if it changed while it was reading. There must be one writer.
+      */
+
+public:
+    explicit SimParamsChannel(const SimParams& params);
+
+    void publish(const SimParams& params);
+    SimParams read() const;
+
+private:
+    static constexpr int nb_values = sizeof(SimParams) / sizeof(float);
+
+    std::atomic<unsigned int> sequence {0};
+    std::atomic<float> values[nb_values];
+};
+
+#endif // SIMPARAMS_H
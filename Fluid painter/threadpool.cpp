@@ -0,0 +1,150 @@
+#include <QtGlobal>
+#include "threadpool.h"
+#include "allocationcheck.h"
+
+inline constexpr int spin_iterations = 2000; // how long the threads wait actively before sleeping
+
+static std::uint64_t pack_range(int begin, int end) {
+    return (std::uint64_t(std::uint32_t(begin)) << 32) | std::uint32_t(end);
+}
+
+static int range_begin(std::uint64_t range) {return int(range >> 32);}
+static int range_end(std::uint64_t range) {return int(range & 0xffffffff);}
+
+ThreadPool::ThreadPool(int _nb_threads) : nb_threads(qMax(1, _nb_threads)) {
+    start_workers();
+}
+
+ThreadPool::~ThreadPool() {
+    stop_workers();
+}
+
+void ThreadPool::set_nb_threads(int _nb_threads) {
+    _nb_threads = qMax(1, _nb_threads);
+    if (_nb_threads == nb_threads) return;
+
+    stop_workers();
+    nb_threads = _nb_threads;
+    start_workers();
+}
+
+void ThreadPool::start_workers() {
+    // The calling thread is thread 0, so we only need nb_threads - 1 workers
+    stopping = false;
+    task_ranges = std::vector<TaskRange>(nb_threads);
+    for (int i = 1; i < nb_threads; i++) {
+        workers.emplace_back(&ThreadPool::worker_loop, this, i, generation.load());
+    }
+}
+
+void ThreadPool::stop_workers() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        generation++;
+    }
+    start_condition.notify_all();
+
+    for (auto& worker : workers) worker.join();
+    workers.clear();
+}
+
+void ThreadPool::run(int _nb_tasks, TaskCaller caller, const void* function) {
+    if (workers.empty() || _nb_tasks <= 1) {
+        for (int task = 0; task < _nb_tasks; task++) caller(function, task, 0);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        task_caller = caller;
+        task_function = function;
+        nb_tasks = _nb_tasks;
+        for (int thread = 0; thread < nb_threads; thread++) {
+            task_ranges[thread].tasks.store(pack_range(thread * nb_tasks / nb_threads, (thread + 1) * nb_tasks / nb_threads),
+                                            std::memory_order_relaxed);
+        }
+        busy_workers.store(int(workers.size()));
+        generation++;
+    }
+    start_condition.notify_all();
+
+    run_tasks(0);
+
+    // barrier: wait until all the workers are done with their tasks
+    for (int i = 0; i < spin_iterations && busy_workers.load(std::memory_order_acquire) > 0; i++) {
+        std::this_thread::yield();
+    }
+    if (busy_workers.load(std::memory_order_acquire) > 0) {
+        std::unique_lock<std::mutex> lock(mutex);
+        done_condition.wait(lock, [this] {return busy_workers.load() == 0;});
+    }
+}
+
+void ThreadPool::run_tasks(int thread) {
+    // Runs the thread's own tasks, then steals from the other threads until they have no tasks left either. A stolen range
+    // is empty in the victim's range before it is in the thief's one, but the thief runs it, so no task is lost.
+    int task;
+    bool found = true;
+    while (found) {
+        while (pop_task(thread, task)) {
+            task_caller(task_function, task, thread);
+        }
+
+        found = false;
+        for (int i = 1; i < nb_threads && !found; i++) {
+            found = steal_tasks(thread, (thread + i) % nb_threads);
+        }
+    }
+}
+
+bool ThreadPool::pop_task(int thread, int& task) {
+    std::atomic<std::uint64_t>& tasks = task_ranges[thread].tasks;
+    std::uint64_t range = tasks.load(std::memory_order_acquire);
+    while (range_begin(range) < range_end(range)) {
+        if (tasks.compare_exchange_weak(range, pack_range(range_begin(range) + 1, range_end(range)), std::memory_order_acq_rel)) {
+            task = range_begin(range);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ThreadPool::steal_tasks(int thread, int victim) {
+    // Moves the back half of the victim's tasks to the thief's range, which is empty
+    std::atomic<std::uint64_t>& tasks = task_ranges[victim].tasks;
+    std::uint64_t range = tasks.load(std::memory_order_acquire);
+    while (range_begin(range) < range_end(range)) {
+        const int middle = range_end(range) - (range_end(range) - range_begin(range) + 1) / 2;
+        if (tasks.compare_exchange_weak(range, pack_range(range_begin(range), middle), std::memory_order_acq_rel)) {
+            task_ranges[thread].tasks.store(pack_range(middle, range_end(range)), std::memory_order_release);
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::worker_loop(int thread, unsigned int seen_generation) {
+#ifdef ALLOCATION_CHECK
+    track_allocations_of_current_thread(true);
+#endif
+    while (true) {
+        // the phases of a step follow each other closely, so we first wait actively for the next one
+        for (int i = 0; i < spin_iterations && generation.load(std::memory_order_acquire) == seen_generation; i++) {
+            std::this_thread::yield();
+        }
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            start_condition.wait(lock, [&] {return generation.load() != seen_generation;});
+            seen_generation = generation.load();
+            if (stopping) return;
+        }
+
+        run_tasks(thread);
+
+        if (busy_workers.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            std::lock_guard<std::mutex> lock(mutex);
+            done_condition.notify_one();
+        }
+    }
+}
@@ -15,19 +15,47 @@ DEFINES += QT_DEPRECATED_WARNINGS
 # You can also select to disable deprecated APIs only up to a certain version of Qt.
 #DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
 
+# The smoothing kernels are calculated on batches of neighbors with SSE2 (always available on x86-64), or with plain
+# loops on other processors. To use AVX2 instead, uncomment the following line: the executable then only runs on
+# processors that support it.
+#QMAKE_CXXFLAGS += -mavx2 -mfma
+
+# Uncomment the following line to count the heap allocations of the simulation steps: the program stops if a step
+# allocates memory once the simulation has warmed up (see allocationcheck.h). The allocations test (tests/allocations) runs
+# each mode of the simulation with this check.
+#DEFINES += ALLOCATION_CHECK
+
 SOURCES += \
+    allocationcheck.cpp \
     grid.cpp \
     main.cpp \
     mainwindow.cpp \
+    neighborlist.cpp \
+    cellhashtable.cpp \
+    autotuner.cpp \
+    availablecores.cpp \
     particle.cpp \
-    particlesystem.cpp
+    particledata.cpp \
+    particlesystem.cpp \
+    simparams.cpp \
+    threadpool.cpp
 
 HEADERS += \
+    allocationcheck.h \
+    floatbatch.h \
     grid.h \
     interaction.h \
     mainwindow.h \
+    neighborlist.h \
+    cellhashtable.h \
+    autotuner.h \
+    availablecores.h \
     particle.h \
-    particlesystem.h
+    particledata.h \
+    particlesystem.h \
+    simparams.h \
+    smoothingkernels.h \
+    threadpool.h
 
 FORMS += \
     mainwindow.ui
@@ -0,0 +1,99 @@
+#include "allocationcheck.h"
+
+#ifdef ALLOCATION_CHECK
+
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <new>
+
+static std::atomic<long long> tracked_allocations {0};
+static thread_local bool current_thread_tracked = false;
+
+void track_allocations_of_current_thread(bool tracked) {
+    current_thread_tracked = tracked;
+}
+
+long long get_tracked_allocations() {
+    return tracked_allocations.load();
+}
+
+static inline void count_allocation() {
+    if (current_thread_tracked) tracked_allocations.fetch_add(1, std::memory_order_relaxed);
+}
+
+#if defined(__GLIBC__)
+
+// The program's malloc replaces the C library's one, which stays available under these names
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* pointer, size_t size);
+extern "C" void* __libc_memalign(size_t alignment, size_t size);
+
+extern "C" void* malloc(size_t size) {
+    count_allocation();
+    return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size) {
+    count_allocation();
+    return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* pointer, size_t size) {
+    count_allocation();
+    return __libc_realloc(pointer, size);
+}
+
+// The aligned allocations (eg: by the aligned forms of operator new) don't go through malloc
+extern "C" void* memalign(size_t alignment, size_t size) {
+    count_allocation();
+    return __libc_memalign(alignment, size);
+}
+
+extern "C" void* aligned_alloc(size_t alignment, size_t size) {
+    count_allocation();
+    return __libc_memalign(alignment, size);
+}
+
+extern "C" int posix_memalign(void** pointer, size_t alignment, size_t size) {
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) return EINVAL;
+    count_allocation();
+    void* allocated = __libc_memalign(alignment, size);
+    if (!allocated) return ENOMEM;
+    *pointer = allocated;
+    return 0;
+}
+
+#else
+
+// operator new is replaced instead; the other forms of new and the deletes use these
+void* operator new(size_t size) {
+    count_allocation();
+    if (void* pointer = std::malloc(size ? size : 1)) return pointer;
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete[](void* pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept {
+    std::free(pointer);
+}
+
+void operator delete[](void* pointer, size_t) noexcept {
+    std::free(pointer);
+}
+
+#endif
+
+#endif
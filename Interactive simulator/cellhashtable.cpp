@@ -0,0 +1,44 @@
+#include "cellhashtable.h"
+
+inline constexpr int min_slots = 64;
+
+CellHashTable::CellHashTable() : table(min_slots, {0, 0, -1}), mask(min_slots - 1) {}
+
+int CellHashTable::insert(QPoint pos) {
+    // Returns the id of the cell at the grid position, after giving it the next id if it was never inserted
+    const int id = find(pos);
+    if (id >= 0) return id;
+
+    positions.push_back(pos);
+    if (2 * positions.size() > table.size()) {
+        // doubles the table, and places the cells again
+        table.assign(2 * table.size(), {0, 0, -1});
+        mask = table.size() - 1;
+        for (int i = 0; i < size(); i++) {
+            place(i);
+        }
+    }
+    else {
+        place(size() - 1);
+    }
+    return size() - 1;
+}
+
+void CellHashTable::clear(int expected_size) {
+    // Removes all the cells, and sizes the table for the given number of cells
+    size_t nb_slots = min_slots;
+    while (nb_slots < 2 * size_t(expected_size)) nb_slots *= 2;
+    table.assign(nb_slots, {0, 0, -1});
+    table.shrink_to_fit();
+    mask = nb_slots - 1;
+    positions.clear();
+}
+
+void CellHashTable::place(int id) {
+    const QPoint pos = positions[id];
+    quint32 slot = hash(pos) & mask;
+    while (table[slot].id >= 0) {
+        slot = (slot + 1) & mask;
+    }
+    table[slot] = {pos.x(), pos.y(), id};
+}
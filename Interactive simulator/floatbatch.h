@@ -0,0 +1,177 @@
+#ifndef FLOATBATCH_H
+#define FLOATBATCH_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define FLOATBATCH_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FLOATBATCH_SSE2
+#endif
+
+class FloatBatch
+{
+    /**
+      * Eight floats that are calculated together with SIMD instructions: one AVX2 register, or two SSE2 registers.
+      * On other processors (eg: ARM), the floats are stored in a plain array, and the loops are simple enough for the
+      * compiler to vectorize them (eg: with NEON).
+      * The comparisons return a mask: each of its lanes has all its bits set when the comparison is true, and none otherwise.
+      */
+
+public:
+    static constexpr int size = 8;
+
+    FloatBatch() = default;
+    FloatBatch(float value); // the same value in all the lanes
+
+    static FloatBatch load(const float* values);
+    static FloatBatch gather(const float* values, const int* indices); // values[indices[0]], values[indices[1]]...
+    void store(float* values) const;
+
+    float sum() const;
+    int mask_bits() const; // bit k is set when lane k of the mask is true
+
+    friend FloatBatch operator+(FloatBatch a, FloatBatch b);
+    friend FloatBatch operator-(FloatBatch a, FloatBatch b);
+    friend FloatBatch operator*(FloatBatch a, FloatBatch b);
+    friend FloatBatch operator/(FloatBatch a, FloatBatch b);
+    friend FloatBatch operator<(FloatBatch a, FloatBatch b);
+    friend FloatBatch operator&(FloatBatch mask, FloatBatch a); // a where the mask is true, 0 elsewhere
+    friend FloatBatch batch_sqrt(FloatBatch a);
+    friend FloatBatch batch_max(FloatBatch a, FloatBatch b);
+    friend FloatBatch batch_fma(FloatBatch a, FloatBatch b, FloatBatch c); // a * b + c
+    friend FloatBatch batch_select(FloatBatch mask, FloatBatch a, FloatBatch b); // a where the mask is true, b elsewhere
+
+private:
+#if defined(FLOATBATCH_AVX2)
+    explicit FloatBatch(__m256 _v) : v(_v) {}
+    __m256 v;
+#elif defined(FLOATBATCH_SSE2)
+    FloatBatch(__m128 _lo, __m128 _hi) : lo(_lo), hi(_hi) {}
+    __m128 lo;
+    __m128 hi;
+#else
+    float v[size];
+#endif
+};
+
+// The kernels and forces are written for both float and FloatBatch, so these functions also exist for float
+inline float batch_sqrt(float a) {return std::sqrt(a);}
+inline float batch_max(float a, float b) {return a > b ? a : b;}
+inline float batch_fma(float a, float b, float c) {return a * b + c;}
+inline float batch_select(bool condition, float a, float b) {return condition ? a : b;}
+
+
+#if defined(FLOATBATCH_AVX2)
+
+inline FloatBatch::FloatBatch(float value) : v(_mm256_set1_ps(value)) {}
+inline FloatBatch FloatBatch::load(const float* values) {return FloatBatch(_mm256_loadu_ps(values));}
+inline FloatBatch FloatBatch::gather(const float* values, const int* indices) {
+    return FloatBatch(_mm256_i32gather_ps(values, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(indices)), 4));
+}
+inline void FloatBatch::store(float* values) const {_mm256_storeu_ps(values, v);}
+inline float FloatBatch::sum() const {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+inline int FloatBatch::mask_bits() const {return _mm256_movemask_ps(v);}
+inline FloatBatch operator+(FloatBatch a, FloatBatch b) {return FloatBatch(_mm256_add_ps(a.v, b.v));}
+inline FloatBatch operator-(FloatBatch a, FloatBatch b) {return FloatBatch(_mm256_sub_ps(a.v, b.v));}
+inline FloatBatch operator*(FloatBatch a, FloatBatch b) {return FloatBatch(_mm256_mul_ps(a.v, b.v));}
+inline FloatBatch operator/(FloatBatch a, FloatBatch b) {return FloatBatch(_mm256_div_ps(a.v, b.v));}
+inline FloatBatch operator<(FloatBatch a, FloatBatch b) {return FloatBatch(_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ));}
+inline FloatBatch operator&(FloatBatch mask, FloatBatch a) {return FloatBatch(_mm256_and_ps(mask.v, a.v));}
+inline FloatBatch batch_sqrt(FloatBatch a) {return FloatBatch(_mm256_sqrt_ps(a.v));}
+inline FloatBatch batch_max(FloatBatch a, FloatBatch b) {return FloatBatch(_mm256_max_ps(a.v, b.v));}
+inline FloatBatch batch_select(FloatBatch mask, FloatBatch a, FloatBatch b) {return FloatBatch(_mm256_blendv_ps(b.v, a.v, mask.v));}
+#if defined(__FMA__)
+inline FloatBatch batch_fma(FloatBatch a, FloatBatch b, FloatBatch c) {return FloatBatch(_mm256_fmadd_ps(a.v, b.v, c.v));}
+#else
+inline FloatBatch batch_fma(FloatBatch a, FloatBatch b, FloatBatch c) {return a * b + c;}
+#endif
+
+#elif defined(FLOATBATCH_SSE2)
+
+inline FloatBatch::FloatBatch(float value) : lo(_mm_set1_ps(value)), hi(_mm_set1_ps(value)) {}
+inline FloatBatch FloatBatch::load(const float* values) {return FloatBatch(_mm_loadu_ps(values), _mm_loadu_ps(values + 4));}
+inline FloatBatch FloatBatch::gather(const float* values, const int* indices) {
+    return FloatBatch(_mm_setr_ps(values[indices[0]], values[indices[1]], values[indices[2]], values[indices[3]]),
+                      _mm_setr_ps(values[indices[4]], values[indices[5]], values[indices[6]], values[indices[7]]));
+}
+inline void FloatBatch::store(float* values) const {_mm_storeu_ps(values, lo); _mm_storeu_ps(values + 4, hi);}
+inline float FloatBatch::sum() const {
+    __m128 s = _mm_add_ps(lo, hi);
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+inline int FloatBatch::mask_bits() const {return _mm_movemask_ps(lo) | (_mm_movemask_ps(hi) << 4);}
+inline FloatBatch operator+(FloatBatch a, FloatBatch b) {return FloatBatch(_mm_add_ps(a.lo, b.lo), _mm_add_ps(a.hi, b.hi));}
+inline FloatBatch operator-(FloatBatch a, FloatBatch b) {return FloatBatch(_mm_sub_ps(a.lo, b.lo), _mm_sub_ps(a.hi, b.hi));}
+inline FloatBatch operator*(FloatBatch a, FloatBatch b) {return FloatBatch(_mm_mul_ps(a.lo, b.lo), _mm_mul_ps(a.hi, b.hi));}
+inline FloatBatch operator/(FloatBatch a, FloatBatch b) {return FloatBatch(_mm_div_ps(a.lo, b.lo), _mm_div_ps(a.hi, b.hi));}
+inline FloatBatch operator<(FloatBatch a, FloatBatch b) {return FloatBatch(_mm_cmplt_ps(a.lo, b.lo), _mm_cmplt_ps(a.hi, b.hi));}
+inline FloatBatch operator&(FloatBatch mask, FloatBatch a) {return FloatBatch(_mm_and_ps(mask.lo, a.lo), _mm_and_ps(mask.hi, a.hi));}
+inline FloatBatch batch_sqrt(FloatBatch a) {return FloatBatch(_mm_sqrt_ps(a.lo), _mm_sqrt_ps(a.hi));}
+inline FloatBatch batch_max(FloatBatch a, FloatBatch b) {return FloatBatch(_mm_max_ps(a.lo, b.lo), _mm_max_ps(a.hi, b.hi));}
+inline FloatBatch batch_select(FloatBatch mask, FloatBatch a, FloatBatch b) {
+    return FloatBatch(_mm_or_ps(_mm_and_ps(mask.lo, a.lo), _mm_andnot_ps(mask.lo, b.lo)),
+                      _mm_or_ps(_mm_and_ps(mask.hi, a.hi), _mm_andnot_ps(mask.hi, b.hi)));
+}
+inline FloatBatch batch_fma(FloatBatch a, FloatBatch b, FloatBatch c) {return a * b + c;}
+
+#else
+
+inline FloatBatch::FloatBatch(float value) {for (int k = 0; k < size; k++) v[k] = value;}
+inline FloatBatch FloatBatch::load(const float* values) {FloatBatch r; for (int k = 0; k < size; k++) r.v[k] = values[k]; return r;}
+inline FloatBatch FloatBatch::gather(const float* values, const int* indices) {
+    FloatBatch r;
+    for (int k = 0; k < size; k++) r.v[k] = values[indices[k]];
+    return r;
+}
+inline void FloatBatch::store(float* values) const {for (int k = 0; k < size; k++) values[k] = v[k];}
+inline float FloatBatch::sum() const {return ((v[0] + v[4]) + (v[2] + v[6])) + ((v[1] + v[5]) + (v[3] + v[7]));}
+inline int FloatBatch::mask_bits() const {
+    int bits = 0;
+    for (int k = 0; k < size; k++) bits |= (std::signbit(v[k]) ? 1 : 0) << k;
+    return bits;
+}
+inline FloatBatch operator+(FloatBatch a, FloatBatch b) {for (int k = 0; k < FloatBatch::size; k++) a.v[k] += b.v[k]; return a;}
+inline FloatBatch operator-(FloatBatch a, FloatBatch b) {for (int k = 0; k < FloatBatch::size; k++) a.v[k] -= b.v[k]; return a;}
+inline FloatBatch operator*(FloatBatch a, FloatBatch b) {for (int k = 0; k < FloatBatch::size; k++) a.v[k] *= b.v[k]; return a;}
+inline FloatBatch operator/(FloatBatch a, FloatBatch b) {for (int k = 0; k < FloatBatch::size; k++) a.v[k] /= b.v[k]; return a;}
+inline FloatBatch operator<(FloatBatch a, FloatBatch b) {
+    for (int k = 0; k < FloatBatch::size; k++) {
+        uint32_t bits = a.v[k] < b.v[k] ? 0xffffffffu : 0u;
+        std::memcpy(&a.v[k], &bits, sizeof(float));
+    }
+    return a;
+}
+inline FloatBatch operator&(FloatBatch mask, FloatBatch a) {
+    for (int k = 0; k < FloatBatch::size; k++) {
+        uint32_t mask_bits;
+        uint32_t value_bits;
+        std::memcpy(&mask_bits, &mask.v[k], sizeof(float));
+        std::memcpy(&value_bits, &a.v[k], sizeof(float));
+        value_bits &= mask_bits;
+        std::memcpy(&a.v[k], &value_bits, sizeof(float));
+    }
+    return a;
+}
+inline FloatBatch batch_sqrt(FloatBatch a) {for (int k = 0; k < FloatBatch::size; k++) a.v[k] = std::sqrt(a.v[k]); return a;}
+inline FloatBatch batch_max(FloatBatch a, FloatBatch b) {for (int k = 0; k < FloatBatch::size; k++) a.v[k] = a.v[k] > b.v[k] ? a.v[k] : b.v[k]; return a;}
+inline FloatBatch batch_select(FloatBatch mask, FloatBatch a, FloatBatch b) {
+    for (int k = 0; k < FloatBatch::size; k++) a.v[k] = std::signbit(mask.v[k]) ? a.v[k] : b.v[k];
+    return a;
+}
+inline FloatBatch batch_fma(FloatBatch a, FloatBatch b, FloatBatch c) {return a * b + c;}
+
+#endif
+
+#endif // FLOATBATCH_H
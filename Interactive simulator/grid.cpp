@@ -1,324 +1,1357 @@
 #include <QtMath>
-#include <future>
-#include <thread>
-#include <mutex>
+#include <algorithm>
+#include <limits>
 #include <vector>
 #include "grid.h"
+#include "allocationcheck.h"
 
 #include <QDebug>
 
 inline constexpr float epsilon = 0.0001;
-inline constexpr int nb_threads = 4;
+inline constexpr int allocation_check_warmup_steps = 100; // the steps after a change that are allowed to allocate
+inline constexpr int tile_size = 8; // the width and height of a tile, in cells: with the halo, about 100 cells of a few particles,
+                                    // whose data fits in the L1/L2 caches
+inline constexpr int min_hashed_cells = 1024; // the hashed storage forgets the cells that emptied when it has more than
+                                              // twice as many ids as occupied cells, plus this margin
+inline constexpr int crowded_cell_size = 64; // a cell with more particles is subdivided in a quadtree
+inline constexpr int quadtree_side = 8; // the finest subdivision of a crowded cell is in 8x8 squares,
+inline constexpr int quadtree_leaf_size = 16; // and a node with more particles than this is split in 4 until it is a square
+inline constexpr int quadtree_nodes_per_cell = 1 + 4 + 16 + 64;
+inline constexpr int max_sub_steps = 32; // the most steps update_particles_for takes, so that a blow up can't freeze the program
+inline constexpr int max_block_levels = 5; // the block time steps split a frame in at most 2^5 = max_sub_steps fine steps
 
-std::mutex mutex_update_particles_pos_on_grid;
-
-Grid::Grid(QPoint _nb_cells, const QSizeF& _world_size, shared_ptr<float> _g, shared_ptr<float> _collision_damping,
-           shared_ptr<float> _fluid_density, shared_ptr<float> _pressure_multiplier, shared_ptr<float> _near_pressure_multiplier,
-           shared_ptr<float> _viscosity_multiplier) :
-                world_size(_world_size), nb_cells(_nb_cells), g(_g), collision_damping(_collision_damping),
-                fluid_density(_fluid_density), pressure_multiplier(_pressure_multiplier), near_pressure_multiplier(_near_pressure_multiplier),
-                viscosity_multiplier(_viscosity_multiplier)
+Grid::Grid(QPoint _nb_cells, const QSizeF& _world_size, shared_ptr<SimParamsChannel> _params_channel, shared_ptr<ThreadPool> _thread_pool,
+           CellStorage _cell_storage) :
+                world_size(_world_size), influence_cells(_nb_cells), nb_cells(_nb_cells), cell_storage(_cell_storage), params_channel(_params_channel),
+                params(_params_channel->read()), thread_pool(_thread_pool), max_threads(_thread_pool->get_nb_threads())
 {
-    particles = QVector<QVector<shared_ptr<Particle>>>(nb_cells.x() * nb_cells.y());
-    random = QRandomGenerator();
+    update_cell_sizes();
+    cell_start = std::vector<int>(get_nb_cell_ids() + 1, 0);
+}
+
+int Grid::add_particle(QPointF pos, QVector2D speed) {
+    // Adds a particle to the grid and returns its id. The particle is placed in its cell at the beginning of the next step.
+    neighbor_list_invalid = true;
+    steps_since_change = 0;
+    wake_cells_around(pos, 0);
+    return data.add(pos, speed);
 }
 
-void Grid::add_particle(shared_ptr<Particle> particle) {
-    int cell_id = cell_id_from_world_pos(particle->get_pos());
-    particles[cell_id].append(particle);
+void Grid::set_neighbor_list_skin(float skin) {
+    // Enables the neighbor lists with the given skin distance, or disables them if skin is 0
+    neighbor_list_skin = skin;
+    neighbor_list_invalid = true;
+    steps_since_change = 0;
 }
 
 void Grid::update_particles(float time_step, const Interaction& interaction) {
     // This function updates the particles' positions and physical states by iterating
     // over the grid. The grids are treated by groups of nine neighboring cells, which
     // allows to test collisions only with neighboring particles.
+    // Each phase only writes the state of the particles it is iterating over, and only reads a state that no other
+    // task of the same phase writes (the new positions and speeds go to the next buffers of ParticleData). So the
+    // threads never interfere, and the result is the same whatever the number of threads.
 
-    std::vector<std::future<void>> threads_update_predicted_pos = std::vector<std::future<void>>(nb_threads);
-    for (int i = 0; i < nb_threads; i++)
-        threads_update_predicted_pos[i] = std::async(&Grid::update_predicted_pos, this, time_step,
-                                                       i * particles.size() / nb_threads, (i + 1) * particles.size() / nb_threads);
-    for (int i = 0; i < nb_threads; i++) threads_update_predicted_pos[i].get();
+#ifdef ALLOCATION_CHECK
+    track_allocations_of_current_thread(true);
+    const long long allocations_before_step = get_tracked_allocations();
+#endif
 
+    const SimParams last_params = params;
+    params = params_channel->read();
+    current_step++;
+    // (the pair buffers are sized for the influence radius and the fluid density)
+    if (params != last_params) steps_since_change = 0;
 
-    // To prevent interference between two threads calculating on the same cell, we first run on
-    // regions 0, 2, 4... and then, on regions 1, 3...
-    std::vector<std::future<void>> threads_update_densities = std::vector<std::future<void>>(nb_threads);
-    for (int i = 0; i < nb_threads; i += 2)
-        threads_update_densities[i] = std::async(&Grid::update_densities, this,
-                                                 i * nb_cells.x() / nb_threads, (i + 1) * nb_cells.x() / nb_threads);
-    for (int i = 0; i < nb_threads; i += 2) threads_update_densities[i].get();
+    // The particles are only reordered when the cells contain all of them (none were added since the last sort)
+    steps_since_reorder++;
+    // (nor in the middle of a frame of block time steps, whose levels are per slot)
+    if (reorder_interval > 0 && steps_since_reorder >= reorder_interval && int(sorted_particles.size()) == data.size()
+            && (!in_block_frame || block_step == 0)) {
+        reorder_particles();
+    }
 
-    for (int i = 1; i < nb_threads; i += 2)
-        threads_update_densities[i] = std::async(&Grid::update_densities, this,
-                                                 i * nb_cells.x() / nb_threads, (i + 1) * nb_cells.x() / nb_threads);
-    for (int i = 1; i < nb_threads; i += 2) threads_update_densities[i].get();
+    const int nb_threads = thread_pool->get_nb_threads();
+    const int nb_particles = data.size();
+    const float h = params.influence_radius;
 
+    // The predicted positions are calculated by the tasks of the first pass over the particles that follows, instead of
+    // having their own pass and barrier
+    if (in_block_frame) {
+        // the particles added during the frame start at the finest level of the frame, which is active at every fine step
+        particle_levels.resize(nb_particles, nb_block_levels);
+        particle_active.resize(nb_particles);
+    }
+    auto predicted_pos = [&](int start_particle, int end_particle) {
+        update_predicted_pos(time_step, start_particle, end_particle);
+        if (in_block_frame) update_time_step_levels(start_particle, end_particle);
+    };
 
-    std::vector<std::future<void>> threads_update_particles_pos_and_speed = std::vector<std::future<void>>(nb_threads);
-    for (int i = 0; i < nb_threads; i += 2)
-        threads_update_particles_pos_and_speed[i] = std::async(&Grid::update_particles_pos_and_speed, this, time_step, interaction,
-                                                 i * nb_cells.x() / nb_threads, (i + 1) * nb_cells.x() / nb_threads);
-    for (int i = 0; i < nb_threads; i += 2) threads_update_particles_pos_and_speed[i].get();
+    // The particles are sorted at the beginning of the step, so that the ones added since the last step are also placed in the grid.
+    // With the neighbor lists, this is only needed when the lists are rebuilt: the cells are then outdated, but they still
+    // contain every particle once, which is all the passes below need. Except for the sleeping cells, which are tested and
+    // woken up on the particles they contain: the particles are then sorted at each step, which keeps the lists (they refer
+    // to the particles' slots, not to their cells).
+    cells_can_sleep = sleep_steps > 0 && !symmetric_forces;
+    if (neighbor_list_skin <= 0) {
+        update_particles_pos_on_grid(predicted_pos);
+    }
+    else if (neighbor_list_outdated(h, predicted_pos)) {
+        update_particles_pos_on_grid();
+        build_neighbor_list(h);
+    }
+    else if (cells_can_sleep) {
+        update_particles_pos_on_grid();
+        // the pairs of the lists may now span more cells, which the search for the active cells around a cell covers
+        if (in_block_frame) update_neighbor_list_reach();
+    }
 
-    for (int i = 1; i < nb_threads; i += 2)
-        threads_update_particles_pos_and_speed[i] = std::async(&Grid::update_particles_pos_and_speed, this, time_step, interaction,
-                                                 i * nb_cells.x() / nb_threads, (i + 1) * nb_cells.x() / nb_threads);
-    for (int i = 1; i < nb_threads; i += 2) threads_update_particles_pos_and_speed[i].get();
+    const int nb_cell_ids = get_nb_cell_ids();
+    const int nb_occupied_cells = occupied_cells.size();
+    if (!cells_can_sleep) {
+        sleeping_cells.clear();
+    }
+    else {
+        if (int(sleeping_cells.size()) != nb_cell_ids) {
+            // the new cells start awake, and calm once they are occupied
+            sleeping_cells.resize(nb_cell_ids, false);
+            cell_move_steps.resize(nb_cell_ids, -1);
+            cell_calm_since.resize(nb_cell_ids, current_step);
+            cell_occupied_steps.resize(nb_cell_ids, -1);
+        }
+        // the frozen state of the sleeping cells was calculated with the last parameters
+        if (params != last_params) wake_all_cells();
+        thread_pool->parallel_for(nb_threads, [&](int task, int) {
+            update_sleeping_cells(task * nb_occupied_cells / nb_threads, (task + 1) * nb_occupied_cells / nb_threads);
+        });
+        if (interaction.radius > 0) wake_cells_around(interaction.pos, interaction.radius); // the cells the user interacts with
+    }
 
+    if (in_block_frame) {
+        if (int(cell_active_steps.size()) != nb_cell_ids) {
+            cell_active_steps.resize(nb_cell_ids, -1);
+        }
+        thread_pool->parallel_for(nb_threads, [&](int task, int) {
+            update_active_cells(task * nb_occupied_cells / nb_threads, (task + 1) * nb_occupied_cells / nb_threads);
+        });
+    }
 
-    // mutex here, because a particle that has a high speed won't necessarily move to a neighbor cell,
-    // so we cannot implement the same trick as previously.
-    std::vector<std::thread> threads_update_particles_pos_on_grid = std::vector<std::thread>(nb_threads);
-    for (int i = 0; i < nb_threads; i++)
-        threads_update_particles_pos_on_grid[i] = std::thread(&Grid::update_particles_pos_on_grid, this,
-                                                          i * particles.size() / nb_threads, (i + 1) * particles.size() / nb_threads);
+    // The occupied cells are split in chunks, or the grid in columns with the symmetric engine
+    const int nb_chunks = nb_threads * chunks_per_thread;
+    if (symmetric_forces) {
+        update_columns();
+    }
+    else {
+        update_chunks(nb_chunks);
+    }
+    pair_buffers.resize(symmetric_forces ? nb_cells.x() : nb_chunks);
+    // The buffers are sized alike, for the most particles that a chunk may hold (or that a column held so far), each with
+    // its padded pairs at the fluid density or at the last step's average, whichever is more. They get twice that room, so
+    // that they don't grow in the steps after the warm-up of the allocation check when a part of the fluid gets denser.
+    const int buffer_particles = symmetric_forces ? max_column_particles : max_chunk_particles;
+    const float particle_pairs = qMax(float(M_PI) * h * h * params.fluid_density, pairs_per_particle) + FloatBatch::size - 1;
+    const int buffer_pairs = qCeil(buffer_particles * particle_pairs);
+    for (PairBuffer& pairs : pair_buffers) {
+        if (pairs.capacity() < buffer_pairs) pairs.reserve(2 * buffer_pairs);
+    }
+    pair_buffer_ids.resize(nb_particles);
+    pair_start.resize(nb_particles);
+    pair_end.resize(nb_particles);
+    reorder_order.reserve(nb_particles); // so that the first reordering doesn't allocate
 
-    for (int i = 0; i < nb_threads; i++) threads_update_particles_pos_on_grid[i].join();
+    update_kernels(h);
+    switch (smoothing_kernel) {
+    case SmoothingKernel::spiky:
+        update_densities_and_forces(spiky_kernels, time_step, interaction);
+        break;
+    case SmoothingKernel::wendland_c2:
+        update_densities_and_forces(wendland_c2_kernels, time_step, interaction);
+        break;
+    case SmoothingKernel::cubic_spline:
+        update_densities_and_forces(cubic_spline_kernels, time_step, interaction);
+        break;
+    }
+
+    data.swap_buffers();
+
+    if (nb_particles > 0) {
+        int nb_pairs = 0;
+        for (const PairBuffer& pairs : pair_buffers) {
+            nb_pairs += pairs.size();
+        }
+        pairs_per_particle = float(nb_pairs) / nb_particles;
+    }
+    max_speed = qSqrt(*std::max_element(task_max_speed.begin(), task_max_speed.end()));
+    max_acceleration = *std::max_element(task_max_acceleration.begin(), task_max_acceleration.end());
+
+#ifdef ALLOCATION_CHECK
+    check_allocations(get_tracked_allocations() - allocations_before_step);
+    track_allocations_of_current_thread(false);
+#endif
 }
 
-void Grid::update_particles_pos_and_speed(float time_step, const Interaction& interaction, int start_cell_pos_x, int end_cell_pos_x) {
-    // Updates the particles forces, position and speed, including the interaction force (when the user clicks on the particle system)
+int Grid::update_particles_for(float duration, const Interaction& interaction) {
+    // Advances the simulation by duration, in steps as long as the time step control allows, so that the caller gets the
+    // same interval whatever happens in the fluid. The remaining time is split evenly, so that no step is much shorter
+    // than the others. Returns the number of steps.
+    // While the auto-tuner is tuning, the frame runs with its candidate configuration, and its time per step is measured.
+    update_auto_tuning();
+    const auto start_time = std::chrono::steady_clock::now();
+
+    int nb_steps = 0;
+    if (block_time_steps && !symmetric_forces) {
+        nb_steps = update_particles_by_blocks(duration, interaction);
+    }
+    else {
+        float remaining = duration;
+        while (remaining > 0 && nb_steps < max_sub_steps) {
+            const float stable_time_step = get_stable_time_step();
+            const int nb_needed = stable_time_step >= remaining ? 1 : qMin(qCeil(remaining / stable_time_step), max_sub_steps - nb_steps);
+            const float time_step = remaining / nb_needed;
+
+            update_particles(time_step, interaction);
+            remaining -= time_step;
+            nb_steps++;
+        }
+    }
+
+    if (auto_tuner.is_tuning() && nb_steps > 0) {
+        auto_tuner.record_frame(std::chrono::duration<float>(std::chrono::steady_clock::now() - start_time).count() / nb_steps);
+    }
+    return nb_steps;
+}
+
+void Grid::update_auto_tuning() {
+    // Starts tuning when the particles, the influence radius or the available cores changed since the last tuning, and
+    // switches to the configuration that the auto-tuner wants for the next frame (the best one once the tuning is over).
+    // Until a tuning starts (eg: with too few particles to measure), the grid keeps its own configuration.
+    if (auto_tuning == AutoTuning::off) return;
+
+    const int nb_particles = data.size();
+    if (auto_tuner.needs_restart(nb_particles, params.influence_radius, max_threads)) {
+        auto_tuner.start({thread_pool->get_nb_threads(), cell_reach, chunks_per_thread}, auto_tuning, max_threads,
+                         nb_particles, params.influence_radius);
+    }
+
+    if (!auto_tuner.has_started()) return;
+
+    const AutoTuner::Config& config = auto_tuner.get_config();
+    thread_pool->set_nb_threads(qMin(config.nb_threads, max_threads));
+    if (config.chunks_per_thread != chunks_per_thread) set_chunks_per_thread(config.chunks_per_thread);
+    if (config.cell_reach != cell_reach) set_cell_reach(config.cell_reach);
+}
+
+int Grid::update_particles_by_blocks(float duration, const Interaction& interaction) {
+    // Splits the frame in as many fine steps as the fastest particle needs (a power of two), and runs them with the block
+    // time steps. Returns the number of fine steps.
+    const float stable_time_step = get_stable_time_step();
+    nb_block_levels = 0;
+    while (nb_block_levels < max_block_levels && duration / (1 << nb_block_levels) > stable_time_step) {
+        nb_block_levels++;
+    }
+
+    // the particles keep the level of their last block, which may be finer than the levels of this frame
+    for (int& level : particle_levels) {
+        level = qMin(level, nb_block_levels);
+    }
+
+    const int nb_steps = 1 << nb_block_levels;
+    block_duration = duration;
+    in_block_frame = true;
+    for (block_step = 0; block_step < nb_steps; block_step++) {
+        update_particles(duration / nb_steps, interaction);
+    }
+    in_block_frame = false;
+    return nb_steps;
+}
+
+void Grid::update_time_step_levels(int start_particle, int end_particle) {
+    // Marks the particles whose block starts at this fine step as active, and chooses their level for this block
+    for (int p = start_particle; p < end_particle; p++) {
+        particle_active[p] = block_step % (1 << (nb_block_levels - particle_levels[p])) == 0;
+        if (!particle_active[p]) continue;
+
+        const float speed = qSqrt(data.vx[p] * data.vx[p] + data.vy[p] * data.vy[p]);
+        const float stable_time_step = get_stable_time_step(speed, data.last_acceleration[p]);
+        int level = 0;
+        while (level < nb_block_levels && block_duration / (1 << level) > stable_time_step) {
+            level++;
+        }
+        // the blocks of a coarser level than the current one may not start at this fine step
+        while (block_step % (1 << (nb_block_levels - level)) != 0) {
+            level++;
+        }
+        particle_levels[p] = level;
+    }
+}
+
+void Grid::update_sleeping_cells(int start_index, int end_index) {
+    // Puts to sleep the occupied cells that stayed calm long enough, and wakes the sleeping cells next to a cell that moved
+    // during the last step. The neighbors' moves were recorded by the last force pass, so this pass reads no state it writes.
+    // A cell that was empty at the last step starts calm, like a cell that wakes up.
+    for (int i = start_index; i < end_index; i++) {
+        const int c = occupied_cells[i];
+        if (cell_occupied_steps[c] != current_step - 1) cell_calm_since[c] = current_step;
+        cell_occupied_steps[c] = current_step;
+
+        bool neighbor_moved = false;
+        for_each_cell_around(c, [&](int n) {
+            if (n != c && cell_move_steps[n] == current_step - 1) neighbor_moved = true;
+        });
+
+        if (sleeping_cells[c]) {
+            if (neighbor_moved) {
+                sleeping_cells[c] = false;
+                cell_calm_since[c] = current_step;
+            }
+        }
+        else if (current_step - cell_calm_since[c] >= sleep_steps && !neighbor_moved) {
+            sleeping_cells[c] = true;
+            for (int p : get_cell(c)) {
+                data.vx[p] = 0;
+                data.vy[p] = 0;
+            }
+        }
+    }
+}
+
+void Grid::update_cell_calm(int cell) {
+    // Records the step if the cell moved, after its particles were updated: it stays awake, and wakes its neighbors
+    const float squared_sleep_speed = sleep_speed * sleep_speed;
+    bool calm = true;
+    for (int p : get_cell(cell)) {
+        if (data.next_vx[p] * data.next_vx[p] + data.next_vy[p] * data.next_vy[p] > squared_sleep_speed
+                || data.last_acceleration[p] > sleep_acceleration) {
+            calm = false;
+            break;
+        }
+    }
+    if (!calm) {
+        cell_move_steps[cell] = current_step;
+        cell_calm_since[cell] = current_step + 1;
+    }
+}
+
+void Grid::wake_cells_around(QPointF pos, float radius) {
+    // Wakes the cells that touch the square around the circle. A cell that wakes up is calm for one step, without counting
+    // as moving, so that it doesn't wake its neighbors.
+    if (sleeping_cells.empty()) return;
 
-    const QVector2D gravity = QVector2D(0, -(*g));
+    const QPoint first = grid_pos_from_world_pos(QPointF(pos.x() - radius, pos.y() - radius));
+    const QPoint last = grid_pos_from_world_pos(QPointF(pos.x() + radius, pos.y() + radius));
+    for (int y = first.y(); y <= last.y(); y++) {
+        for (int x = first.x(); x <= last.x(); x++) {
+            const int cell = cell_id_from_grid_pos({x, y});
+            if (cell >= 0 && sleeping_cells[cell]) {
+                sleeping_cells[cell] = false;
+                cell_calm_since[cell] = current_step;
+            }
+        }
+    }
+}
 
-    for (int i = start_cell_pos_x; i < qMin(end_cell_pos_x, nb_cells.x()); i++) {
-        for (int j = 0; j < nb_cells.y(); j++) {
-            for (auto particle : particles[cell_id_from_grid_pos({i, j})]) {
-                QVector<QVector2D> forces = QVector<QVector2D>();
-                forces.append(gravity);
-                forces.append(calculate_pressure_force(particle) / particle->get_density());
-                forces.append(calculate_viscosity_force(particle));
-                forces.append(interaction_force(particle, interaction));
-                particle->update_forces(forces);
+void Grid::wake_all_cells() {
+    // Wakes every cell, calm for one step like the cells that wake_cells_around wakes up
+    std::fill(sleeping_cells.begin(), sleeping_cells.end(), false);
+    std::fill(cell_calm_since.begin(), cell_calm_since.end(), current_step);
+}
 
-                particle->update_pos_and_speed(time_step);
+void Grid::update_active_cells(int start_index, int end_index) {
+    // Dates the occupied cells that have an active particle with the current step
+    for (int i = start_index; i < end_index; i++) {
+        const int c = occupied_cells[i];
+        for (int p : get_cell(c)) {
+            if (particle_active[p]) {
+                cell_active_steps[c] = current_step;
+                break;
             }
         }
     }
 }
 
-void Grid::update_predicted_pos(float time_step, int start_cell_id, int end_cell_id) {
-    for (int i = start_cell_id; i < qMin(end_cell_id, particles.size()); i++) {
-        for (auto particle : particles[i]) {
-            particle->update_predicted_pos(time_step);
+float Grid::get_stable_time_step() const {
+    return get_stable_time_step(max_speed, max_acceleration);
+}
+
+float Grid::get_stable_time_step(float speed, float acceleration) const {
+    // The longest time step allowed by the time step control for this speed and acceleration
+    const float h = params.influence_radius;
+    float time_step = std::numeric_limits<float>::max();
+    if (cfl_factor > 0 && speed > 0) {
+        time_step = qMin(time_step, cfl_factor * h / speed);
+    }
+    if (force_factor > 0 && acceleration > 0) {
+        time_step = qMin(time_step, force_factor * float(qSqrt(h / acceleration)));
+    }
+    return time_step;
+}
+
+void Grid::check_allocations(long long allocations) {
+    // Stops the program if a step allocated memory although nothing changed during the last steps
+    if (thread_pool->get_nb_threads() != last_nb_threads) {
+        last_nb_threads = thread_pool->get_nb_threads();
+        steps_since_change = 0;
+    }
+
+    if (steps_since_change >= allocation_check_warmup_steps && allocations > 0) {
+        qFatal("Grid::update_particles made %lld heap allocations in a steady state step", allocations);
+    }
+    steps_since_change++;
+}
+
+bool Grid::is_allocation_checked() const {
+    // Whether the next step is checked, which it is once the steps since the last change are past the warm-up
+    return steps_since_change >= allocation_check_warmup_steps;
+}
+
+void Grid::update_particles_pos_and_speed(float time_step, const Interaction& interaction, int chunk) {
+    // Updates the particles forces, position and speed, including the interaction force (when the user clicks on the particle system)
+
+    const QVector2D gravity = QVector2D(0, -params.g);
+    const float damping = params.collision_damping;
+    const float radius = get_particle_radius();
+
+    for_each_cell_of_chunk(chunk, [&](int cell) {
+        if (cells_can_sleep && sleeping_cells[cell]) {
+            for (int p : get_cell(cell)) {
+                data.keep_pos_and_speed(p);
+            }
+            return;
+        }
+
+        for (int p : get_cell(cell)) {
+            if (in_block_frame && !particle_active[p]) {
+                // the particle only drifts
+                data.update_pos_and_speed(p, QVector2D(0, 0), time_step, radius, damping, world_size);
+                record_motion(chunk, p);
+                continue;
+            }
+
+            QVector2D acceleration = gravity
+                                   + calculate_pressure_force(p) / data.density[p]
+                                   + calculate_viscosity_force(p)
+                                   + interaction_force(data.get_pos(p), data.get_speed(p), interaction);
+            data.last_acceleration[p] = acceleration.length();
+
+            // with the block time steps, the kick covers the particle's whole block, but the drift only this fine step
+            const float block_scale = in_block_frame ? 1 << (nb_block_levels - particle_levels[p]) : 1;
+            data.update_pos_and_speed(p, acceleration * block_scale, time_step, radius, damping, world_size);
+            record_motion(chunk, p);
+        }
+
+        if (cells_can_sleep) {
+            update_cell_calm(cell);
         }
+    });
+}
+
+template<typename Prologue>
+bool Grid::neighbor_list_outdated(float h, const Prologue& prologue) {
+    // The list must be rebuilt when a particle may have moved into the influence radius of a particle that is not in its list.
+    // Each task first calls prologue on its particles.
+    const int nb_tasks = thread_pool->get_nb_threads();
+    const int nb_particles = data.size();
+    const bool invalid = neighbor_list_invalid || neighbor_list.influence_radius != h;
+    task_results.assign(nb_tasks, 0);
+
+    thread_pool->parallel_for(nb_tasks, [&](int task, int) {
+        const int start_particle = task * nb_particles / nb_tasks;
+        const int end_particle = (task + 1) * nb_particles / nb_tasks;
+        prologue(start_particle, end_particle);
+        if (!invalid) task_results[task] = neighbor_list.max_squared_displacement(data, start_particle, end_particle);
+    });
+
+    if (invalid)
+        return true;
+
+    float max_displacement = qSqrt(*std::max_element(task_results.begin(), task_results.end()));
+    return max_displacement > neighbor_list_skin / 2;
+}
+
+void Grid::build_neighbor_list(float h) {
+    // Builds the neighbor lists in two passes: the first one counts the neighbors of each particle, which gives the offsets
+    // of the lists, and the second one writes them.
+
+    const int nb_tasks = thread_pool->get_nb_threads();
+    const int nb_particles = data.size();
+    const float cutoff = h + neighbor_list_skin;
+
+    neighbor_list.offsets.resize(nb_particles + 1);
+    neighbor_list.ref_px.resize(nb_particles);
+    neighbor_list.ref_py.resize(nb_particles);
+
+    thread_pool->parallel_for(nb_tasks, [&](int task, int) {
+        find_neighbors(task * nb_particles / nb_tasks, (task + 1) * nb_particles / nb_tasks, cutoff, true);
+    });
+
+    neighbor_list.offsets[0] = 0;
+    for (int p = 0; p < nb_particles; p++) {
+        neighbor_list.offsets[p + 1] += neighbor_list.offsets[p];
     }
+    neighbor_list.indices.resize(neighbor_list.offsets[nb_particles]);
+
+    thread_pool->parallel_for(nb_tasks, [&](int task, int) {
+        find_neighbors(task * nb_particles / nb_tasks, (task + 1) * nb_particles / nb_tasks, cutoff, false);
+        neighbor_list.save_reference_pos(data, task * nb_particles / nb_tasks, (task + 1) * nb_particles / nb_tasks);
+    });
+
+    neighbor_list.influence_radius = h;
+    neighbor_list_invalid = false;
+    update_neighbor_list_reach();
 }
 
-void Grid::update_densities(int start_cell_pos_x, int end_cell_pos_x) {
-    for (int i = start_cell_pos_x; i < qMin(end_cell_pos_x, nb_cells.x()); i++) {
-        for (int j = 0; j < nb_cells.y(); j++) {
-            for (auto particle : particles[cell_id_from_grid_pos({i, j})]) {
-                particle->update_density(calculate_density(particle));
+void Grid::update_neighbor_list_reach() {
+    // Measures the most cells, along a row or a column, between the cells of the two particles of a pair of the lists. The
+    // pairs are found around the predicted positions, with a cutoff of the influence radius plus the skin, while the cells
+    // follow the current positions: the reach is measured on the pairs rather than derived from the cutoff.
+    const int nb_tasks = thread_pool->get_nb_threads();
+    const int nb_particles = data.size();
+
+    task_results.assign(nb_tasks, 0);
+    thread_pool->parallel_for(nb_tasks, [&](int task, int) {
+        int reach = 0;
+        for (int p = task * nb_particles / nb_tasks; p < (task + 1) * nb_particles / nb_tasks; p++) {
+            const QPoint pos = grid_pos_from_cell_id(particle_cells[p]);
+            for (int j : neighbor_list.get_neighbors(p)) {
+                const QPoint neighbor_pos = grid_pos_from_cell_id(particle_cells[j]);
+                reach = qMax(reach, qMax(qAbs(neighbor_pos.x() - pos.x()), qAbs(neighbor_pos.y() - pos.y())));
             }
         }
+        task_results[task] = reach;
+    });
+    neighbor_list_reach = int(*std::max_element(task_results.begin(), task_results.end()));
+}
+
+void Grid::find_neighbors(int start_particle, int end_particle, float cutoff, bool count_only) {
+    // Counts the neighbors of the particles (stored in offsets[p + 1]), or writes them in the lists. The cutoff reaches
+    // further than the stencil of the cells around a particle, so the search covers all the cells that it touches: otherwise
+    // two particles between the influence radius and the cutoff, in cells two apart, would come within the influence radius
+    // before the lists are rebuilt without being in each other's list.
+    const float squared_cutoff = cutoff * cutoff;
+
+    for (int p = start_particle; p < end_particle; p++) {
+        const float x = data.px[p];
+        const float y = data.py[p];
+        int count = 0;
+        int* neighbors = count_only ? nullptr : neighbor_list.indices.data() + neighbor_list.offsets[p];
+
+        for_each_particle_in_cells_within(x, y, cutoff, [&](int j) {
+            float dx = data.px[j] - x;
+            float dy = data.py[j] - y;
+            if (dx * dx + dy * dy < squared_cutoff) {
+                if (!count_only) neighbors[count] = j;
+                count++;
+            }
+        });
+
+        if (count_only) neighbor_list.offsets[p + 1] = count;
     }
 }
 
-void Grid::update_particles_pos_on_grid(int start_cell_id, int end_cell_id) {
-    // Updates the grid so as to place all the particles in the right cell.
+void Grid::update_predicted_pos(float time_step, int start_particle, int end_particle) {
+    const float radius = get_particle_radius();
 
-    std::lock_guard<std::mutex> guard(mutex_update_particles_pos_on_grid);
+    for (int p = start_particle; p < end_particle; p++) {
+        data.update_predicted_pos(p, time_step, radius, world_size);
+    }
+}
+
+void Grid::update_kernels(float h) {
+    if (spiky_kernels.influence_radius != h) {
+        spiky_kernels = SpikyKernels(h);
+        wendland_c2_kernels = WendlandC2Kernels(h);
+        cubic_spline_kernels = CubicSplineKernels(h);
+    }
+}
+
+template<typename Kernels>
+void Grid::update_densities_and_forces(const Kernels& kernels, float time_step, const Interaction& interaction) {
+    // The density pass is instantiated for each set of kernels, so that they are inlined in its inner loop
+    const int nb_threads = thread_pool->get_nb_threads();
+    const int nb_particles = data.size();
+    const int nb_chunks = int(chunk_start.size()) - 1;
+
+    task_max_speed.assign(symmetric_forces ? nb_threads : nb_chunks, 0);
+    task_max_acceleration.assign(symmetric_forces ? nb_threads : nb_chunks, 0);
+
+    if (symmetric_forces) {
+        pair_force_x.resize(nb_particles);
+        pair_force_y.resize(nb_particles);
 
-    for (int i = start_cell_id; i < qMin(end_cell_id, particles.size()); i++) {
-        int j = 0;
-        while (j < particles[i].size()) {
-            auto particle = particles[i][j];
-            int new_cell_id = cell_id_from_world_pos(particle->get_pos());
+        thread_pool->parallel_for(nb_threads, [&](int task, int) {
+            reset_densities(kernels, task * nb_particles / nb_threads, (task + 1) * nb_particles / nb_threads);
+        });
+        for_each_column_by_color([&](int column) {
+            update_column_densities(kernels, column);
+        });
 
-            if (new_cell_id != i) {
-                particles[i].remove(j);
-                particles[new_cell_id].append(particle);
+        thread_pool->parallel_for(nb_threads, [&](int task, int) {
+            update_pressures(task * nb_particles / nb_threads, (task + 1) * nb_particles / nb_threads);
+        });
+        for_each_column_by_color([&](int column) {
+            add_column_pair_forces(column);
+        });
+
+        thread_pool->parallel_for(nb_threads, [&](int task, int) {
+            integrate_particles(time_step, interaction, task, task * nb_particles / nb_threads, (task + 1) * nb_particles / nb_threads);
+        });
+        return;
+    }
+
+    // The densities and forces of the full engine are one task graph: the forces of a chunk start as soon as the densities
+    // of the chunks around it are done, so the threads don't wait for the whole grid between the two passes
+    update_chunk_dependencies(nb_chunks);
+    for (int c : occupied_cells) {
+        cell_costs[c] = 0;
+    }
+
+    thread_pool->parallel_for(nb_chunks, [&](int chunk, int) {
+        update_densities(kernels, chunk);
+
+        // The thread that completes the last density chunk needed by a force chunk runs it
+        for (int i = dependent_start[chunk]; i < dependent_start[chunk + 1]; i++) {
+            const int force_chunk = dependents[i];
+            if (remaining_dependencies[force_chunk].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                update_particles_pos_and_speed(time_step, interaction, force_chunk);
             }
-            else {
-                j++;
+        }
+    });
+}
+
+template<typename Kernels>
+void Grid::reset_densities(const Kernels& kernels, int start_particle, int end_particle) {
+    // Starts the densities with the particle itself, before the symmetric engine adds the pairs to both of their particles
+    const float self_density = kernels.density(0.f);
+    const float self_near_density = kernels.near_density(0.f);
+
+    for (int p = start_particle; p < end_particle; p++) {
+        data.density[p] = self_density;
+        data.near_density[p] = self_near_density;
+        pair_force_x[p] = 0;
+        pair_force_y[p] = 0;
+    }
+}
+
+template<typename Kernels>
+void Grid::update_column_densities(const Kernels& kernels, int column) {
+    // Adds the density of each pair found from the column's particles to both particles, and records the pair in the column's buffer
+    const float influence_radius = kernels.influence_radius;
+    const float squared_influence_radius = influence_radius * influence_radius;
+    PairBuffer& pairs = pair_buffers[column];
+    pairs.clear();
+
+    for (int k = column_start[column]; k < column_start[column + 1]; k++) {
+        for (int i : get_cell(column_cells[k])) {
+            pair_buffer_ids[i] = column;
+            pair_start[i] = pairs.size();
+
+            const float x_i = data.px[i];
+            const float y_i = data.py[i];
+            for_each_forward_neighbor(i, x_i, y_i, influence_radius, [&](int j) {
+                float dx = data.px[j] - x_i;
+                float dy = data.py[j] - y_i;
+                float squared_distance = dx * dx + dy * dy;
+                if (squared_distance >= squared_influence_radius) return;
+
+                float distance = qSqrt(squared_distance);
+                float density = kernels.density(distance);
+                float near_density = kernels.near_density(distance);
+                data.density[i] += density;
+                data.density[j] += density;
+                data.near_density[i] += near_density;
+                data.near_density[j] += near_density;
+
+                QVector2D dir = distance > epsilon ? QVector2D(dx / distance, dy / distance) : separation_direction(data.ids[i], data.ids[j]);
+                pairs.add(j, dir.x(), dir.y(), kernels.slope(distance), kernels.viscosity(distance));
+            });
+
+            pair_end[i] = pairs.size();
+        }
+    }
+}
+
+void Grid::add_column_pair_forces(int column) {
+    // Adds the pressure and viscosity accelerations of the pairs found from the column's particles to both particles.
+    // The pair's shared terms are calculated once; the pressure is divided by each particle's own density, and the
+    // viscosity is exactly opposite.
+    const PairBuffer& pairs = pair_buffers[column];
+    const float viscosity = params.viscosity_multiplier;
+
+    for (int k = column_start[column]; k < column_start[column + 1]; k++) {
+        for (int i : get_cell(column_cells[k])) {
+            const float density = data.density[i];
+            const float near_density = data.near_density[i];
+            const float pressure = data.pressure[i];
+            const float near_pressure = data.near_pressure[i];
+
+            for (int k = pair_start[i]; k < pair_end[i]; k++) {
+                const int j = pairs.j[k];
+                const float density2 = data.density[j];
+                const float near_density2 = data.near_density[j];
+                const float pressure2 = data.pressure[j];
+                const float near_pressure2 = data.near_pressure[j];
+
+                float shared_pressure = 0.5f * (pressure + pressure2) * pairs.slope[k];
+                float shared_near_pressure = 0.5f * (near_pressure + near_pressure2) * pairs.slope[k];
+                float magnitude = (shared_pressure / density + shared_near_pressure / near_density) / density;
+                float magnitude2 = (shared_pressure / density2 + shared_near_pressure / near_density2) / density2;
+
+                float influence = pairs.viscosity_influence[k] * viscosity;
+                float viscosity_x = (data.vx[j] - data.vx[i]) * influence;
+                float viscosity_y = (data.vy[j] - data.vy[i]) * influence;
+
+                pair_force_x[i] += magnitude * pairs.dir_x[k] + viscosity_x;
+                pair_force_y[i] += magnitude * pairs.dir_y[k] + viscosity_y;
+                pair_force_x[j] -= magnitude2 * pairs.dir_x[k] + viscosity_x;
+                pair_force_y[j] -= magnitude2 * pairs.dir_y[k] + viscosity_y;
             }
         }
     }
 }
 
-int Grid::cell_id_from_world_pos(QPointF pos) {
-    // Returns the id of the cell containing the world position
+void Grid::integrate_particles(float time_step, const Interaction& interaction, int task, int start_particle, int end_particle) {
+    // Updates the position and speed of the particles, from the accelerations accumulated by the symmetric engine
+    const QVector2D gravity = QVector2D(0, -params.g);
+    const float damping = params.collision_damping;
+    const float radius = get_particle_radius();
 
-    float cells_width = world_size.width() / nb_cells.x();
-    float cells_height = world_size.height() / nb_cells.y();
-    int cell_id = int(pos.y() / cells_height) * nb_cells.x() + int(pos.x() / cells_width);
-    return cell_id;
+    for (int p = start_particle; p < end_particle; p++) {
+        QVector2D acceleration = gravity
+                               + QVector2D(pair_force_x[p], pair_force_y[p])
+                               + interaction_force(data.get_pos(p), data.get_speed(p), interaction);
+
+        data.last_acceleration[p] = acceleration.length();
+        data.update_pos_and_speed(p, acceleration, time_step, radius, damping, world_size);
+        record_motion(task, p);
+    }
 }
 
-QVector<QPoint> Grid::get_neighbor_cells(QPoint pos) {
-    // Returns the positions on the grid of the neighbor cells
+template<typename Kernels>
+void Grid::update_densities(const Kernels& kernels, int chunk) {
+    // Updates the densities, and records the neighbor pairs of the particles in the chunk's pair buffer
+    PairBuffer& pairs = pair_buffers[chunk];
+    pairs.clear();
 
-    QVector<QPoint> cells = QVector<QPoint>();
-    cells.append(pos);
-    if (pos.x() > 0) {
-        cells.append({pos.x() - 1, pos.y()});
-        if (pos.y() > 0) {
-            cells.append({pos.x() - 1, pos.y() - 1});
+    for_each_cell_of_chunk(chunk, [&](int cell) {
+        // with the block time steps, only the forces of the active particles are calculated, which only need the densities
+        // of their neighbors
+        if (in_block_frame && !is_near_active_cell(cell)) return;
+        if (cells_can_sleep && sleeping_cells[cell]) return;
+
+        for (int p : get_cell(cell)) {
+            pair_buffer_ids[p] = chunk;
+            pair_start[p] = pairs.size();
+
+            auto [density, near_density] = calculate_density(p, kernels, pairs);
+            data.density[p] = density;
+            data.near_density[p] = near_density;
+            update_pressure(p);
+
+            while ((pairs.size() - pair_start[p]) % FloatBatch::size != 0) {
+                pairs.add(p, 0, 0, 0, 0);
+            }
+            pair_end[p] = pairs.size();
         }
-        if (pos.y() < nb_cells.y() - 1) {
-            cells.append({pos.x() - 1, pos.y() + 1});
+    });
+}
+
+void Grid::update_particles_pos_on_grid() {
+    update_particles_pos_on_grid([](int, int) {});
+}
+
+template<typename Prologue>
+void Grid::update_particles_pos_on_grid(const Prologue& prologue) {
+    // Updates the grid so as to place all the particles in the right cell. This is a counting sort: each task
+    // counts its particles in each cell, the counts are turned into offsets, then each task writes its particles
+    // at these offsets. A task's particles are written after the previous tasks' ones, so the order is stable.
+    // Each task first calls prologue on its particles.
+    // The tasks list the cells they count particles in, so that only the occupied cells are visited, and the list of the
+    // occupied cells is then sorted in the traversal order of the passes. Only the starts of the empty cells are filled.
+
+    const int nb_tasks = thread_pool->get_nb_threads();
+    const int nb_particles = data.size();
+
+    if (cell_storage == CellStorage::hashed && hashed_cells.size() > 2 * int(occupied_cells.size()) + min_hashed_cells) {
+        // most of the ids belong to cells that emptied: the table restarts from the cells of the particles
+        hashed_cells.clear(occupied_cells.size());
+        reset_cells();
+    }
+
+    particle_cells.resize(nb_particles);
+    sorted_particles.resize(nb_particles);
+    cell_offsets.resize(nb_tasks);
+    task_new_cells.resize(nb_tasks);
+    task_new_cell_particles.resize(nb_tasks);
+    for (auto& offsets : cell_offsets) {
+        offsets.resize(get_nb_cell_ids(), 0);
+    }
+
+    thread_pool->parallel_for(nb_tasks, [&](int task, int) {
+        prologue(task * nb_particles / nb_tasks, (task + 1) * nb_particles / nb_tasks);
+        count_particles_in_cells(task, task * nb_particles / nb_tasks, (task + 1) * nb_particles / nb_tasks);
+    });
+    if (cell_storage == CellStorage::hashed) {
+        add_hashed_cells();
+    }
+
+    const int nb_cell_ids = get_nb_cell_ids();
+    cell_start.resize(nb_cell_ids + 1);
+    cell_costs.resize(nb_cell_ids, 0);
+
+    occupied_cells.clear();
+    for (const std::vector<int>& new_cells : task_new_cells) {
+        occupied_cells.insert(occupied_cells.end(), new_cells.begin(), new_cells.end());
+    }
+    std::sort(occupied_cells.begin(), occupied_cells.end());
+    occupied_cells.erase(std::unique(occupied_cells.begin(), occupied_cells.end()), occupied_cells.end());
+
+    // prefix sum over the occupied cells, then over the tasks within a cell. The empty cells start where the next occupied
+    // cell starts, so that the cells of a row stay contiguous ranges.
+    int offset = 0;
+    int next_cell = 0;
+    for (int c : occupied_cells) {
+        std::fill(cell_start.begin() + next_cell, cell_start.begin() + c + 1, offset);
+        for (int t = 0; t < nb_tasks; t++) {
+            int count = cell_offsets[t][c];
+            cell_offsets[t][c] = offset;
+            offset += count;
+        }
+        next_cell = c + 1;
+    }
+    std::fill(cell_start.begin() + next_cell, cell_start.end(), offset);
+
+    thread_pool->parallel_for(nb_tasks, [&](int task, int) {
+        sort_particles_in_cells(task, task * nb_particles / nb_tasks, (task + 1) * nb_particles / nb_tasks);
+    });
+
+    update_quadtrees();
+    update_traversal_order();
+}
+
+void Grid::count_particles_in_cells(int task, int start_particle, int end_particle) {
+    std::vector<int>& counts = cell_offsets[task];
+    std::vector<int>& new_cells = task_new_cells[task];
+    std::vector<int>& new_cell_particles = task_new_cell_particles[task];
+    new_cells.clear();
+    new_cell_particles.clear();
+    for (int p = start_particle; p < end_particle; p++) {
+        int cell_id = cell_id_from_world_pos(data.get_pos(p));
+        if (cell_id < 0) {
+            // the cell has no id yet in the hashed storage, which is only changed by add_hashed_cells
+            new_cell_particles.push_back(p);
+            continue;
         }
+        particle_cells[p] = cell_id;
+        if (counts[cell_id]++ == 0) new_cells.push_back(cell_id);
     }
-    if (pos.x() < nb_cells.x() - 1) {
-        cells.append({pos.x() + 1, pos.y()});
-        if (pos.y() > 0) {
-            cells.append({pos.x() + 1, pos.y() - 1});
+}
+
+void Grid::add_hashed_cells() {
+    // Gives ids to the cells of the particles that the counting tasks left, and counts these particles
+    for (const std::vector<int>& new_cell_particles : task_new_cell_particles) {
+        for (int p : new_cell_particles) {
+            particle_cells[p] = hashed_cells.insert(grid_pos_from_world_pos(data.get_pos(p)));
         }
-        if (pos.y() < nb_cells.y() - 1) {
-            cells.append({pos.x() + 1, pos.y() + 1});
+    }
+
+    for (int t = 0; t < int(cell_offsets.size()); t++) {
+        std::vector<int>& counts = cell_offsets[t];
+        counts.resize(hashed_cells.size(), 0);
+        for (int p : task_new_cell_particles[t]) {
+            if (counts[particle_cells[p]]++ == 0) task_new_cells[t].push_back(particle_cells[p]);
         }
     }
-    if (pos.y() > 0) {
-        cells.append({pos.x(), pos.y() - 1});
+}
+
+void Grid::sort_particles_in_cells(int task, int start_particle, int end_particle) {
+    std::vector<int>& offsets = cell_offsets[task];
+    for (int p = start_particle; p < end_particle; p++) {
+        sorted_particles[offsets[particle_cells[p]]++] = p;
+    }
+    // ready for the next sort
+    for (int c : occupied_cells) {
+        offsets[c] = 0;
+    }
+}
+
+int Grid::cell_id_from_world_pos(QPointF pos) const {
+    // Returns the id of the cell containing the world position (never a ghost cell), or -1 if it has no id (hashed storage)
+    return cell_id_from_grid_pos(grid_pos_from_world_pos(pos));
+}
+
+void Grid::update_cell_sizes() {
+    padded_width = nb_cells.x() + 2 * cell_reach;
+    inverse_cell_width = nb_cells.x() / world_size.width();
+    inverse_cell_height = nb_cells.y() / world_size.height();
+
+    if (cell_storage == CellStorage::hashed) {
+        hashed_cells.clear(occupied_cells.size());
+    }
+    reset_cells();
+}
+
+void Grid::reset_cells() {
+    // Forgets the states of the cells, whose ids change with the grid or when the hashed storage restarts
+    sleeping_cells.clear();
+    cell_move_steps.clear();
+    cell_calm_since.clear();
+    cell_occupied_steps.clear();
+    cell_active_steps.clear();
+    cell_costs.clear();
+    crowded_cells.clear();
+    cell_quadtrees.clear();
+}
+
+int Grid::get_nb_cell_ids() const {
+    // The size of the arrays indexed by cell id: the whole grid with its ghost cells, or the ids of the hash table
+    if (cell_storage == CellStorage::hashed) return hashed_cells.size();
+    return padded_width * (nb_cells.y() + 2 * cell_reach);
+}
+
+void Grid::update_traversal_order() {
+    // Sorts the occupied cells in the traversal order of the passes
+    ranked_cells.clear();
+    for (int c : occupied_cells) {
+        ranked_cells.push_back({traversal_rank(grid_pos_from_cell_id(c)), c});
+    }
+    std::sort(ranked_cells.begin(), ranked_cells.end());
+
+    occupied_ranks.resize(ranked_cells.size());
+    for (int i = 0; i < int(ranked_cells.size()); i++) {
+        occupied_ranks[i] = ranked_cells[i].first;
+        occupied_cells[i] = ranked_cells[i].second;
     }
-    if (pos.y() < nb_cells.y() - 1) {
-        cells.append({pos.x(), pos.y() + 1});
+}
+
+void Grid::update_quadtrees() {
+    // Subdivides the crowded cells, in parallel since each one only rewrites its own range of the sorted index array
+    for (int c : crowded_cells) {
+        cell_quadtrees[c] = -1;
     }
+    cell_quadtrees.resize(get_nb_cell_ids(), -1);
 
-    return cells;
+    crowded_cells.clear();
+    for (int c : occupied_cells) {
+        if (cell_start[c + 1] - cell_start[c] > crowded_cell_size) crowded_cells.push_back(c);
+    }
+    if (crowded_cells.empty()) return;
+
+    quadtree_nodes.resize(crowded_cells.size() * quadtree_nodes_per_cell);
+    thread_quadtree_buffers.resize(thread_pool->get_nb_threads());
+    thread_pool->parallel_for(crowded_cells.size(), [&](int index, int thread) {
+        build_quadtree(index, thread);
+    });
 }
 
-pair<float, float> Grid::calculate_density(const shared_ptr<Particle>& particle) {
-    float density = 0;
-    float near_density = 0;
+void Grid::build_quadtree(int index, int thread) {
+    // Sorts the particles of a crowded cell by the square of its 8x8 subdivision that contains their predicted position, in
+    // Z-order, so that each node of the quadtree (a square of 1, 4, 16 or 64 of these) is a range of them. The order of the
+    // particles within a square is kept, so the result doesn't depend on the threads.
+    const int cell = crowded_cells[index];
+    const int first = cell_start[cell];
+    const QPoint pos = grid_pos_from_cell_id(cell);
+    auto square_of = [&](int p) {
+        const int x = qBound(0, int((data.px[p] * inverse_cell_width - pos.x()) * quadtree_side), quadtree_side - 1);
+        const int y = qBound(0, int((data.py[p] * inverse_cell_height - pos.y()) * quadtree_side), quadtree_side - 1);
+        return int(morton_code(x, y));
+    };
 
-    QPointF pos = particle->get_predicted_pos();
-    QVector<QPoint> cells = get_neighbor_cells(cell_id_from_world_pos(pos));
-    for (QPoint cell : cells) {
-        for (auto particle2 : particles[cell_id_from_grid_pos(cell)]) {
-            float distance = QVector2D(particle2->get_predicted_pos() - pos).length();
-            float influence = density_smoothing_kernel(particle->get_influence_radius(), distance);
-            density += influence;
+    std::vector<int>& particles = thread_quadtree_buffers[thread];
+    particles.assign(sorted_particles.begin() + first, sorted_particles.begin() + cell_start[cell + 1]);
 
-            float near_influence = near_density_smoothing_kernel(particle->get_influence_radius(), distance);
-            near_density += near_influence;
+    constexpr int nb_squares = quadtree_side * quadtree_side;
+    int square_start[nb_squares + 1] = {};
+    for (int p : particles) {
+        square_start[square_of(p) + 1]++;
+    }
+    for (int s = 0; s < nb_squares; s++) {
+        square_start[s + 1] += square_start[s];
+    }
+    int offsets[nb_squares];
+    std::copy(square_start, square_start + nb_squares, offsets);
+    for (int p : particles) {
+        sorted_particles[first + offsets[square_of(p)]++] = p;
+    }
+
+    const int root = index * quadtree_nodes_per_cell;
+    int next_node = root + 1;
+    build_quadtree_node(root, next_node, first, square_start, 0, nb_squares);
+    cell_quadtrees[cell] = root;
+}
+
+void Grid::build_quadtree_node(int node, int& next_node, int first, const int* square_start, int first_square, int nb_squares) {
+    // Builds the node made of nb_squares squares from first_square (in Z-order), whose particles start at first in the sorted
+    // index array. It is split in 4 while it has more than quadtree_leaf_size particles and more than one square. Its
+    // bounding box is the one of its particles, or of its children's boxes.
+    QuadtreeNode& n = quadtree_nodes[node];
+    n.first = first + square_start[first_square];
+    n.last = first + square_start[first_square + nb_squares];
+    n.min_x = n.min_y = std::numeric_limits<float>::max();
+    n.max_x = n.max_y = std::numeric_limits<float>::lowest();
+
+    if (n.last - n.first <= quadtree_leaf_size || nb_squares == 1) {
+        n.children = -1;
+        for (int k = n.first; k < n.last; k++) {
+            const int p = sorted_particles[k];
+            n.min_x = qMin(n.min_x, data.px[p]);
+            n.min_y = qMin(n.min_y, data.py[p]);
+            n.max_x = qMax(n.max_x, data.px[p]);
+            n.max_y = qMax(n.max_y, data.py[p]);
         }
+        return;
+    }
+
+    n.children = next_node;
+    next_node += 4;
+    for (int k = 0; k < 4; k++) {
+        build_quadtree_node(n.children + k, next_node, first, square_start, first_square + k * nb_squares / 4, nb_squares / 4);
+        const QuadtreeNode& child = quadtree_nodes[n.children + k];
+        n.min_x = qMin(n.min_x, child.min_x);
+        n.min_y = qMin(n.min_y, child.min_y);
+        n.max_x = qMax(n.max_x, child.max_x);
+        n.max_y = qMax(n.max_y, child.max_y);
     }
+}
 
-    // In some cases, when the predicted position is too far away from the current position, the density calculated above remains zero.
-    // So we need to prevent this, because it would cause divisions by zero.
-    density = density != 0 ? density : density_smoothing_kernel(particle->get_influence_radius(), 0);
-    near_density = near_density != 0 ? near_density : near_density_smoothing_kernel(particle->get_influence_radius(), 0);
+void Grid::update_columns() {
+    // Lists the occupied cells of each column, from bottom to top, for the symmetric engine
+    column_cells.assign(occupied_cells.begin(), occupied_cells.end());
+    std::sort(column_cells.begin(), column_cells.end(), [&](int a, int b) {
+        const QPoint pos_a = grid_pos_from_cell_id(a);
+        const QPoint pos_b = grid_pos_from_cell_id(b);
+        return pos_a.x() != pos_b.x() ? pos_a.x() < pos_b.x() : pos_a.y() < pos_b.y();
+    });
 
-    return {density, near_density};
+    column_start.assign(nb_cells.x() + 1, 0);
+    for (int c : column_cells) {
+        column_start[grid_pos_from_cell_id(c).x() + 1]++;
+    }
+    for (int x = 0; x < nb_cells.x(); x++) {
+        column_start[x + 1] += column_start[x];
+    }
+
+    for (int x = 0; x < nb_cells.x(); x++) {
+        int column_particles = 0;
+        for (int k = column_start[x]; k < column_start[x + 1]; k++) {
+            column_particles += cell_start[column_cells[k] + 1] - cell_start[column_cells[k]];
+        }
+        max_column_particles = qMax(max_column_particles, column_particles);
+    }
 }
 
-pair<float, float> Grid::density_to_pressure(float density, float near_density) {
-    float density_error = density - *fluid_density;
-    float pressure = density_error * *pressure_multiplier;
-    float near_pressure = near_density * *near_pressure_multiplier;
-    return {pressure, near_pressure};
+void Grid::update_chunks(int nb_chunks) {
+    // Splits the occupied cells (in traversal order) in nb_chunks consecutive ranges of about the same cost. The pairs of a
+    // chunk go to its own buffer, which is sized for max_chunk_particles particles: a chunk is closed before it would get
+    // more, and it is only closed for its cost if the particles left fit in the chunks left.
+    float measured_cost = 0;
+    int max_cell_particles = 0;
+    for (int c : occupied_cells) {
+        measured_cost += cell_costs[c];
+        max_cell_particles = qMax(max_cell_particles, cell_start[c + 1] - cell_start[c]);
+    }
+    const bool measured = measured_cost > 0;
+
+    auto cell_cost = [&](int c) -> float {
+        return measured ? cell_costs[c] : cell_start[c + 1] - cell_start[c];
+    };
+    const float total_cost = measured ? measured_cost : cell_start.back();
+
+    // a chunk can always take free_particles more particles, and all the chunks together take at least all the particles
+    const int share = (cell_start.back() + nb_chunks - 1) / nb_chunks;
+    max_chunk_particles = share + qMax(share, max_cell_particles);
+    const int free_particles = max_chunk_particles - max_cell_particles;
+
+    const int nb_occupied_cells = occupied_cells.size();
+    chunk_start.resize(nb_chunks + 1);
+    chunk_start[0] = 0;
+    int chunk = 1;
+    float cost = 0;
+    int chunk_particles = 0;
+    int particles_left = cell_start.back();
+    for (int i = 0; i < nb_occupied_cells && chunk < nb_chunks; i++) {
+        const int c = occupied_cells[i];
+        const int cell_particles = cell_start[c + 1] - cell_start[c];
+        if (chunk_particles + cell_particles > max_chunk_particles) {
+            chunk_start[chunk++] = i;
+            chunk_particles = 0;
+        }
+        cost += cell_cost(c);
+        chunk_particles += cell_particles;
+        particles_left -= cell_particles;
+        while (chunk < nb_chunks && cost >= total_cost * chunk / nb_chunks
+               && particles_left <= (nb_chunks - chunk) * free_particles) {
+            chunk_start[chunk++] = i + 1;
+            chunk_particles = 0;
+        }
+    }
+    while (chunk <= nb_chunks) {
+        chunk_start[chunk++] = nb_occupied_cells;
+    }
 }
 
-QVector2D Grid::calculate_pressure_force(const shared_ptr<Particle>& particle) {
-    QVector2D pressure_force = QVector2D(0, 0);
+void Grid::update_chunk_dependencies(int nb_chunks) {
+    // The forces of a chunk read the densities of its tiles and of their neighbor tiles, so they depend on the density
+    // chunks of these tiles. For each density chunk, lists the force chunks that depend on it.
+    // The cells of a tile are a range of ranks, so its occupied cells are found by a binary search in the traversal order,
+    // and they belong to a range of chunks.
+    const quint64 tile_area = tile_size * tile_size;
+    auto chunk_of = [&](int index) {
+        return int(std::upper_bound(chunk_start.begin(), chunk_start.end(), index) - chunk_start.begin()) - 1;
+    };
 
-    QPointF pos = particle->get_predicted_pos();
-    float density = particle->get_density();
-    float near_density = particle->get_near_density();
+    if (int(remaining_dependencies.size()) != nb_chunks) {
+        remaining_dependencies = std::vector<std::atomic<int>>(nb_chunks);
+    }
+    dependent_start.assign(nb_chunks + 1, 0);
+    dependency_marks.assign(nb_chunks, -1);
 
-    QVector<QPoint> cells = get_neighbor_cells(cell_id_from_world_pos(pos));
-    for (QPoint cell : cells) {
-        for (auto particle2 : particles[cell_id_from_grid_pos(cell)]) {
-            if (particle2->get_id() != particle->get_id()) {
-                QVector2D dir = QVector2D(particle2->get_predicted_pos() - pos);
+    // calls function on each density chunk that the force chunk depends on, once
+    auto for_each_dependency = [&](int force_chunk, auto function) {
+        quint64 previous_tile = std::numeric_limits<quint64>::max();
+        for (int i = chunk_start[force_chunk]; i < chunk_start[force_chunk + 1]; i++) {
+            if (occupied_ranks[i] / tile_area == previous_tile) continue;
+            previous_tile = occupied_ranks[i] / tile_area;
 
-                float slope = density_smoothing_kernel_derivative(particle->get_influence_radius(), dir.length());
+            const QPoint pos = grid_pos_from_cell_id(occupied_cells[i]);
+            const int tile_x = pos.x() / tile_size;
+            const int tile_y = pos.y() / tile_size;
+            for (int y = qMax(0, tile_y - 1); y <= tile_y + 1; y++) {
+                for (int x = qMax(0, tile_x - 1); x <= tile_x + 1; x++) {
+                    const quint64 first_rank = morton_code(x, y) * tile_area;
+                    const auto first = std::lower_bound(occupied_ranks.begin(), occupied_ranks.end(), first_rank);
+                    const auto last = std::lower_bound(first, occupied_ranks.end(), first_rank + tile_area);
+                    if (first == last) continue; // no particles
 
-                while (dir.length() <= epsilon) {
-                    dir = QVector2D(random.generateDouble() * 2 - 1, random.generateDouble() * 2 - 1);
+                    const int last_chunk = chunk_of(last - occupied_ranks.begin() - 1);
+                    for (int density_chunk = chunk_of(first - occupied_ranks.begin()); density_chunk <= last_chunk; density_chunk++) {
+                        if (dependency_marks[density_chunk] != force_chunk) {
+                            dependency_marks[density_chunk] = force_chunk;
+                            function(density_chunk);
+                        }
+                    }
                 }
+            }
+        }
+    };
 
-                float density2 = particle2->get_density();
-                float near_density2 = particle2->get_near_density();
+    // counts the dependents of each density chunk, then turns the counts into offsets and writes the lists
+    for (int f = 0; f < nb_chunks; f++) {
+        int count = 0;
+        for_each_dependency(f, [&](int d) {dependent_start[d + 1]++; count++;});
+        remaining_dependencies[f].store(count, std::memory_order_relaxed);
+    }
+    for (int c = 0; c < nb_chunks; c++) {
+        dependent_start[c + 1] += dependent_start[c];
+    }
+    dependents.resize(dependent_start[nb_chunks]);
 
-                auto [pressure, near_pressure] = density_to_pressure(density, near_density);
-                auto [pressure2, near_pressure2] = density_to_pressure(density2, near_density2);
+    dependency_marks.assign(nb_chunks, -1);
+    dependency_offsets.assign(dependent_start.begin(), dependent_start.end() - 1);
+    for (int f = 0; f < nb_chunks; f++) {
+        for_each_dependency(f, [&](int d) {dependents[dependency_offsets[d]++] = f;});
+    }
+}
 
-                pressure_force += 0.5 * (pressure + pressure2) * dir.normalized() * slope / density
-                                 + 0.5 * (near_pressure + near_pressure2) * dir.normalized() * slope / near_density;
-            }
+void Grid::reorder_particles() {
+    // Renumbers the particles' slots in the traversal order of their cells. The cells and neighbor lists refer to the old
+    // slots, so they are rebuilt by this step.
+    reorder_order.clear();
+    for (int cell : occupied_cells) {
+        for (int p : get_cell(cell)) {
+            reorder_order.push_back(p);
         }
     }
 
-    return pressure_force;
+    data.reorder(reorder_order);
+    neighbor_list_invalid = true;
+    steps_since_reorder = 0;
 }
 
-QVector2D Grid::calculate_viscosity_force(const shared_ptr<Particle>& particle) {
-    QVector2D viscosity_force = QVector2D(0, 0);
+template<typename Kernels>
+pair<float, float> Grid::calculate_density(int i, const Kernels& kernels, PairBuffer& pairs) {
+    // Calculates the density at the particle's predicted position. The neighbors within the influence radius are recorded
+    // in pairs, with what the force passes need, so that the distances and kernels are only calculated once per step.
+    // The candidate neighbors are gathered by batches, whose kernels are calculated together; the out of range lanes are masked.
+    const float influence_radius = kernels.influence_radius;
+    const FloatBatch squared_h = influence_radius * influence_radius;
+
+    FloatBatch density = 0;
+    FloatBatch near_density = 0;
+
+    const float x = data.px[i];
+    const float y = data.py[i];
+
+    int batch_j[FloatBatch::size];
+    float batch_dx[FloatBatch::size];
+    float batch_dy[FloatBatch::size];
+    int count = 0;
 
-    QPointF pos = particle->get_predicted_pos();
+    auto add_batch = [&]() {
+        for (int k = count; k < FloatBatch::size; k++) {
+            // padding, out of range
+            batch_j[k] = i;
+            batch_dx[k] = influence_radius;
+            batch_dy[k] = 0;
+        }
+
+        FloatBatch dx = FloatBatch::load(batch_dx);
+        FloatBatch dy = FloatBatch::load(batch_dy);
+        FloatBatch squared_distance = batch_fma(dx, dx, dy * dy);
+        FloatBatch in_range = squared_distance < squared_h;
+        FloatBatch distance = batch_sqrt(squared_distance);
+        density = density + (in_range & kernels.density(distance));
+        near_density = near_density + (in_range & kernels.near_density(distance));
 
-    QVector<QPoint> cells = get_neighbor_cells(cell_id_from_world_pos(pos));
-    for (QPoint cell : cells) {
-        for (auto particle2 : particles[cell_id_from_grid_pos(cell)]) {
-            if (particle2->get_id() != particle->get_id()) {
-                float dst = QVector2D(particle2->get_pos() - pos).length();
-                float influence = viscosity_smoothing_kernel(particle->get_influence_radius(), dst);
-                viscosity_force += (particle2->get_speed() - particle->get_speed()) * influence;
+        int in_range_bits = in_range.mask_bits();
+        if (in_range_bits != 0) {
+            float batch_distance[FloatBatch::size];
+            float batch_slope[FloatBatch::size];
+            float batch_viscosity[FloatBatch::size];
+            distance.store(batch_distance);
+            kernels.slope(distance).store(batch_slope);
+            kernels.viscosity(distance).store(batch_viscosity);
+
+            for (int k = 0; k < count; k++) {
+                if (!(in_range_bits & (1 << k))) continue;
+                float d = batch_distance[k];
+                QVector2D dir = d > epsilon ? QVector2D(batch_dx[k] / d, batch_dy[k] / d) : separation_direction(data.ids[i], data.ids[batch_j[k]]);
+                pairs.add(batch_j[k], dir.x(), dir.y(), batch_slope[k], batch_viscosity[k]);
             }
         }
+        count = 0;
+    };
+
+    for_each_neighbor(i, x, y, influence_radius, [&](int j) {
+        if (j == i) return;
+        batch_j[count] = j;
+        batch_dx[count] = data.px[j] - x;
+        batch_dy[count] = data.py[j] - y;
+        if (++count == FloatBatch::size) add_batch();
+    });
+    if (count > 0) add_batch();
+
+    // the particle itself (this also prevents the density from being zero, which would cause divisions by zero)
+    return {kernels.density(0.f) + density.sum(), kernels.near_density(0.f) + near_density.sum()};
+}
+
+void Grid::update_pressures(int start_particle, int end_particle) {
+    // Calculates the pressures from the densities, so that the force passes only read them
+    for (int p = start_particle; p < end_particle; p++) {
+        update_pressure(p);
+    }
+}
+
+QVector2D Grid::calculate_pressure_force(int i) {
+    // The pairs are processed by batches: the neighbors' pressures are gathered, and the lanes are summed at the end
+    const PairBuffer& pairs = pair_buffers[pair_buffer_ids[i]];
+
+    const float density = data.density[i];
+    const float near_density = data.near_density[i];
+    const FloatBatch pressure = data.pressure[i];
+    const FloatBatch near_pressure = data.near_pressure[i];
+    const FloatBatch half_inverse_density = 0.5f / density;
+    const FloatBatch half_inverse_near_density = 0.5f / near_density;
+
+    FloatBatch force_x = 0;
+    FloatBatch force_y = 0;
+
+    for (int k = pair_start[i]; k < pair_end[i]; k += FloatBatch::size) {
+        FloatBatch pressure2 = FloatBatch::gather(data.pressure.data(), &pairs.j[k]);
+        FloatBatch near_pressure2 = FloatBatch::gather(data.near_pressure.data(), &pairs.j[k]);
+
+        FloatBatch magnitude = batch_fma(pressure + pressure2, half_inverse_density,
+                                         (near_pressure + near_pressure2) * half_inverse_near_density)
+                             * FloatBatch::load(&pairs.slope[k]);
+
+        force_x = batch_fma(magnitude, FloatBatch::load(&pairs.dir_x[k]), force_x);
+        force_y = batch_fma(magnitude, FloatBatch::load(&pairs.dir_y[k]), force_y);
     }
 
-    return viscosity_force * *viscosity_multiplier;
+    return QVector2D(force_x.sum(), force_y.sum());
 }
 
-void Grid::change_grid(QPoint _nb_cells) {
-    // Changes the grid cells' size and number, and updates the particles
-    nb_cells = _nb_cells;
-    auto new_particles = QVector<QVector<shared_ptr<Particle>>>(nb_cells.x() * nb_cells.y());
-
-    for (auto cell : particles) {
-        for (auto particle : cell) {
-            int new_cell_id = cell_id_from_world_pos(particle->get_pos());
-            new_particles[new_cell_id].append(particle);
-        }
+QVector2D Grid::calculate_viscosity_force(int i) {
+    const PairBuffer& pairs = pair_buffers[pair_buffer_ids[i]];
+
+    const FloatBatch vx = data.vx[i];
+    const FloatBatch vy = data.vy[i];
+
+    FloatBatch force_x = 0;
+    FloatBatch force_y = 0;
+
+    for (int k = pair_start[i]; k < pair_end[i]; k += FloatBatch::size) {
+        FloatBatch influence = FloatBatch::load(&pairs.viscosity_influence[k]);
+        force_x = batch_fma(FloatBatch::gather(data.vx.data(), &pairs.j[k]) - vx, influence, force_x);
+        force_y = batch_fma(FloatBatch::gather(data.vy.data(), &pairs.j[k]) - vy, influence, force_y);
     }
 
-    particles = new_particles;
+    return QVector2D(force_x.sum(), force_y.sum()) * params.viscosity_multiplier;
 }
 
-float density_smoothing_kernel(float influence_radius, float distance) {
-    if (distance >= influence_radius) return 0;
-    float volume = M_PI * qPow(influence_radius, 4) / 6;
-    return (influence_radius - distance) * (influence_radius - distance) / volume;
+void Grid::change_grid(QPoint _nb_cells) {
+    // Changes the grid cells' size and number (given for cells of one influence radius), and updates the particles
+    influence_cells = _nb_cells;
+    nb_cells = influence_cells * cell_reach;
+    update_cell_sizes();
+    update_particles_pos_on_grid();
+    neighbor_list_invalid = true;
+    steps_since_change = 0;
+}
+
+void Grid::set_max_threads(int _max_threads) {
+    // Sets the number of cores available to the simulation: without auto-tuning, the thread pool uses them all, otherwise
+    // the tuning starts again with at most this many threads
+    max_threads = qMax(1, _max_threads);
+    if (auto_tuning == AutoTuning::off) thread_pool->set_nb_threads(max_threads);
 }
 
-float density_smoothing_kernel_derivative(float influence_radius, float distance) {
-    if (distance >= influence_radius) return 0;
-    float scale = 12 / (M_PI * qPow(influence_radius, 4));
-    return -scale * (influence_radius - distance);
+void Grid::set_cell_reach(int reach) {
+    // Divides the cells of one influence radius in reach x reach smaller cells, whose neighbors are searched reach cells
+    // around them
+    cell_reach = qBound(1, reach, max_cell_reach);
+    change_grid(influence_cells);
 }
 
-float near_density_smoothing_kernel(float influence_radius, float distance) {
-    if (distance >= influence_radius) return 0;
-    float volume = M_PI * qPow(influence_radius, 5) / 10;
-    return qPow((influence_radius - distance), 3) / volume;
+quint32 morton_code(int x, int y) {
+    // Interleaves the bits of x and y (16 bits each)
+    auto spread = [](quint32 v) {
+        v &= 0xffff;
+        v = (v | (v << 8)) & 0x00ff00ff;
+        v = (v | (v << 4)) & 0x0f0f0f0f;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+    };
+    return spread(quint32(x)) | (spread(quint32(y)) << 1);
 }
 
-float near_density_smoothing_kernel_derivative(float influence_radius, float distance) {
-    if (distance >= influence_radius) return 0;
-    float scale = 30 / (M_PI * qPow(influence_radius, 5));
-    return -scale * (influence_radius - distance) * (influence_radius - distance);
+quint64 traversal_rank(QPoint pos) {
+    const quint64 tile_rank = morton_code(pos.x() / tile_size, pos.y() / tile_size);
+    return tile_rank * (tile_size * tile_size) + (pos.y() % tile_size) * tile_size + pos.x() % tile_size;
 }
 
-float viscosity_smoothing_kernel(float influence_radius, float distance) {
-    if (distance >= influence_radius) return 0;
-    float value = influence_radius * influence_radius - distance * distance;
-    return qPow(value, 3);
+QVector2D separation_direction(int i, int j) {
+    // Returns a pseudo random direction that only depends on the two particles (and is opposite for the other particle),
+    // so that the simulation stays deterministic
+    quint32 hash = quint32(qMin(i, j)) * 73856093u ^ quint32(qMax(i, j)) * 19349663u;
+    hash = (hash ^ (hash >> 16)) * 0x45d9f3bu;
+    hash ^= hash >> 16;
+
+    float angle = (hash & 0xffff) * float(2 * M_PI / 65536);
+    QVector2D dir = QVector2D(qCos(angle), qSin(angle));
+    return i < j ? dir : -dir;
 }
 
-QVector2D interaction_force(shared_ptr<Particle> particle, Interaction interaction) {
+QVector2D interaction_force(QPointF pos, QVector2D speed, const Interaction& interaction) {
     QVector2D interac_force = {0, 0};
 
-    QVector2D offset = QVector2D((interaction.pos - particle->get_pos()));
+    QVector2D offset = QVector2D((interaction.pos - pos));
     float dst = offset.length();
 
     if (dst < interaction.radius) {
         QVector2D dirToInputPoint = offset.normalized();
         float centerT = 1 - dst / interaction.radius;
-        interac_force += (dirToInputPoint * interaction.strength - particle->get_speed()) * centerT;
+        interac_force += (dirToInputPoint * interaction.strength - speed) * centerT;
     }
 
     return interac_force;
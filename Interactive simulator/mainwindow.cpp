@@ -1,15 +1,17 @@
 #include <QTimer>
 #include <QtMath>
+#include <QString>
 
 #include "mainwindow.h"
 #include "ui_mainwindow.h"
+#include "availablecores.h"
 
 #include <QDebug>
 
 inline constexpr float nb_particles = 10000;
 inline const QSize window_size = QSize(1000, 800);
 inline const QSizeF world_size =  QSizeF(10.0, 8.0);
-inline constexpr float time_step = 0.01;
+inline constexpr float time_step = 0.01; // the simulated time between two frames
 inline constexpr float init_g = 0.0;
 inline constexpr float init_pressure_multiplier = 0.0;
 inline constexpr float init_near_pressure_multiplier = 0.0;
@@ -20,10 +22,25 @@ inline constexpr float particle_radius = 0.03;
 inline constexpr float init_particle_influence_radius = 0.25;
 inline constexpr float init_interaction_radius = 1.0;
 inline constexpr float init_interaction_strength = 50.0;
+inline constexpr CellStorage cell_storage = CellStorage::dense; // hashed: the memory of the grid follows the particles instead of the world
+inline constexpr float neighbor_list_skin = 0.05; // the neighbors are searched up to influence radius + skin, and reused while the particles move slowly
+inline constexpr SmoothingKernel smoothing_kernel = SmoothingKernel::spiky; // the density kernel (spiky, Wendland C2 or cubic spline)
+inline constexpr bool symmetric_forces = false; // visits each pair of neighbors once and applies its forces to both particles
+inline constexpr int reorder_interval = 100; // the particles are sorted in the Z-order of their cells every this many steps (0: never)
+inline constexpr float cfl_factor = 0.4; // a frame is split in steps during which the fastest particle moves less than this many influence radii
+inline constexpr float force_factor = 0.25; // and short enough for the largest acceleration a: dt < force_factor * sqrt(influence radius / a)
+inline constexpr bool block_time_steps = false; // each particle only gets the steps its own speed and acceleration need
+inline constexpr float sleep_speed = 0.1; // the cells whose particles stay slower than this,
+inline constexpr float sleep_acceleration = 2.0; // with a smaller acceleration than this,
+inline constexpr int sleep_steps = 30; // during this many steps (0: never) are put to sleep until a neighbor cell moves
+inline constexpr AutoTuning auto_tuning = AutoTuning::full; // the threads, cell size and chunks are chosen by measuring the frames
+inline constexpr int cores_check_interval = 1000; // the ms between two checks of the cores available (a container's CPU quota can change)
 
 MainWindow::MainWindow(QWidget *parent) : QMainWindow(parent), ui(new Ui::MainWindow)
 {
     ui->setupUi(this);
+    // The threads are sized after the cores the process may use (its affinity and its container's CPU quota), not the machine's
+    const int nb_threads = count_available_cores();
     particle_system = new ParticleSystem(nb_particles,
                                          particle_radius,
                                          init_particle_influence_radius,
@@ -38,8 +55,19 @@ MainWindow::MainWindow(QWidget *parent) : QMainWindow(parent), ui(new Ui::MainWi
                                          init_viscosity_multiplier,
                                          init_interaction_radius,
                                          init_interaction_strength,
+                                         nb_threads,
+                                         cell_storage,
                                          this);
 
+    particle_system->set_neighbor_list_skin(neighbor_list_skin);
+    particle_system->set_smoothing_kernel(smoothing_kernel);
+    particle_system->set_symmetric_forces(symmetric_forces);
+    particle_system->set_reorder_interval(reorder_interval);
+    particle_system->set_time_step_factors(cfl_factor, force_factor);
+    particle_system->set_block_time_steps(block_time_steps);
+    particle_system->set_sleep_thresholds(sleep_speed, sleep_acceleration, sleep_steps);
+    particle_system->set_auto_tuning(auto_tuning);
+
     ui->mainLayout->addWidget(particle_system);
     particle_system->setFocus();
     resize(1000, 800);
@@ -77,6 +105,11 @@ MainWindow::MainWindow(QWidget *parent) : QMainWindow(parent), ui(new Ui::MainWi
     auto timer = new QTimer(parent);
     QObject::connect(timer, SIGNAL(timeout()), particle_system, SLOT(update_physics()));
     timer->start(2);
+
+    auto cores_timer = new QTimer(this);
+    QObject::connect(cores_timer, SIGNAL(timeout()), this, SLOT(update_available_cores()));
+    cores_timer->start(cores_check_interval);
+    update_available_cores();
 }
 
 void MainWindow::set_gravity(int val) {
@@ -133,6 +166,12 @@ void MainWindow::set_collision_damping(int val) {
     ui->labelCollisionDampingValue->setNum(collision_damping);
 }
 
+void MainWindow::update_available_cores() {
+    // Follows the cores the process may use, and shows how many threads the simulation runs on
+    particle_system->update_available_cores();
+    ui->statusbar->showMessage(QString("%1 threads, %2 available cores").arg(particle_system->get_nb_threads())
+                                                                        .arg(particle_system->get_available_cores()));
+}
 
 MainWindow::~MainWindow()
 {
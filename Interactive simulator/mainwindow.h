@@ -26,6 +26,7 @@ public slots:
     void set_interaction_radius(int val);
     void set_interaction_strength(int val);
     void set_collision_damping(int val);
+    void update_available_cores();
 
 private:
     Ui::MainWindow* ui;
@@ -0,0 +1,20 @@
+#include <QtGlobal>
+#include "neighborlist.h"
+
+void NeighborList::save_reference_pos(const ParticleData& data, int start_particle, int end_particle) {
+    for (int p = start_particle; p < end_particle; p++) {
+        ref_px[p] = data.px[p];
+        ref_py[p] = data.py[p];
+    }
+}
+
+float NeighborList::max_squared_displacement(const ParticleData& data, int start_particle, int end_particle) const {
+    // Returns the largest squared distance a particle's predicted position has moved since the list was built
+    float max_dst = 0;
+    for (int p = start_particle; p < end_particle; p++) {
+        float dx = data.px[p] - ref_px[p];
+        float dy = data.py[p] - ref_py[p];
+        max_dst = qMax(max_dst, dx * dx + dy * dy);
+    }
+    return max_dst;
+}
@@ -0,0 +1,44 @@
+#ifndef NEIGHBORLIST_H
+#define NEIGHBORLIST_H
+
+#include <vector>
+#include "particledata.h"
+
+class NeighborList
+{
+    /**
+      * This class stores, for each particle, the particles that were closer than the influence radius plus a skin distance
+      * when the list was built (Verlet lists). As long as no particle has moved by more than half the skin, every pair of
+      * particles closer than the influence radius is still in the list, so the list can be reused for several steps
+      * instead of scanning the neighboring cells at each pass.
+      * The lists are stored in a compact format (CSR): the neighbors of particle i are indices[offsets[i]] to
+      * indices[offsets[i + 1] - 1].
+      */
+
+public:
+    struct Neighbors {
+        const int* first;
+        const int* last;
+        const int* begin() const {return first;}
+        const int* end() const {return last;}
+    };
+
+    inline Neighbors get_neighbors(int i) const {
+        return {indices.data() + offsets[i], indices.data() + offsets[i + 1]};
+    }
+
+    void save_reference_pos(const ParticleData& data, int start_particle, int end_particle);
+    float max_squared_displacement(const ParticleData& data, int start_particle, int end_particle) const;
+
+public:
+    std::vector<int> offsets;
+    std::vector<int> indices;
+
+    // The predicted positions of the particles when the list was built
+    std::vector<float> ref_px;
+    std::vector<float> ref_py;
+
+    float influence_radius = 0; // the influence radius the list was built for
+};
+
+#endif // NEIGHBORLIST_H
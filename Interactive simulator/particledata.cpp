@@ -0,0 +1,104 @@
+#include "particledata.h"
+
+int ParticleData::add(QPointF pos, QVector2D speed) {
+    // Adds a particle at the end of the arrays and returns its id
+    ids.push_back(size());
+    id_slots.push_back(size());
+    x.push_back(pos.x());
+    y.push_back(pos.y());
+    vx.push_back(speed.x());
+    vy.push_back(speed.y());
+    px.push_back(pos.x());
+    py.push_back(pos.y());
+    density.push_back(0);
+    near_density.push_back(0);
+    pressure.push_back(0);
+    near_pressure.push_back(0);
+    next_x.push_back(pos.x());
+    next_y.push_back(pos.y());
+    next_vx.push_back(speed.x());
+    next_vy.push_back(speed.y());
+    last_acceleration.push_back(0);
+    reorder_buffer.push_back(0);
+    reorder_ids.push_back(0);
+    return size() - 1;
+}
+
+void ParticleData::reorder(const std::vector<int>& order) {
+    // Moves the particle of slot order[k] to slot k. Only the state kept from one step to the next is moved, which includes
+    // the densities and pressures, since the particles of the sleeping cells keep theirs: the other arrays (predicted
+    // positions, next state) are calculated again during the next step.
+    for (std::vector<float>* values : {&x, &y, &vx, &vy, &last_acceleration, &density, &near_density, &pressure, &near_pressure}) {
+        reorder_buffer.resize(order.size());
+        for (size_t k = 0; k < order.size(); k++) {
+            reorder_buffer[k] = (*values)[order[k]];
+        }
+        values->swap(reorder_buffer);
+    }
+
+    reorder_ids.resize(order.size());
+    for (size_t k = 0; k < order.size(); k++) {
+        reorder_ids[k] = ids[order[k]];
+        id_slots[reorder_ids[k]] = int(k);
+    }
+    ids.swap(reorder_ids);
+}
+
+void ParticleData::swap_buffers() {
+    x.swap(next_x);
+    y.swap(next_y);
+    vx.swap(next_vx);
+    vy.swap(next_vy);
+}
+
+void ParticleData::update_predicted_pos(int i, float time_step, float radius, const QSizeF& world_size) {
+    px[i] = x[i] + vx[i] * time_step;
+    py[i] = y[i] + vy[i] * time_step;
+
+    if (px[i] - radius < 0)
+        px[i] = radius;
+    else if (px[i] + radius >= world_size.width())
+        px[i] = world_size.width() - radius;
+
+    if (py[i] - radius < 0)
+        py[i] = radius;
+    else if (py[i] + radius >= world_size.height())
+        py[i] = world_size.height() - radius;
+}
+
+void ParticleData::update_pos_and_speed(int i, QVector2D acceleration, float time_step, float radius, float collision_damping,
+                                        const QSizeF& world_size) {
+    float new_vx = vx[i] + acceleration.x() * time_step;
+    float new_vy = vy[i] + acceleration.y() * time_step;
+
+    float new_x = x[i] + new_vx * time_step;
+    float new_y = y[i] + new_vy * time_step;
+
+    // when the particle gets outside of the screen
+    if (new_x - radius < 0) {
+        new_x = radius;
+        new_vx = -new_vx * collision_damping;
+        new_vy *= collision_damping;
+    }
+    else if (new_x + radius >= world_size.width()) {
+        new_x = world_size.width() - radius;
+        new_vx = -new_vx * collision_damping;
+        new_vy *= collision_damping;
+    }
+
+    if (new_y - radius < 0) {
+        new_y = radius;
+        new_vy = -new_vy * collision_damping;
+        new_vx *= collision_damping;
+    }
+    else if (new_y + radius >= world_size.height()) {
+        new_y = world_size.height() - radius;
+        new_vy = -new_vy * collision_damping;
+        new_vx *= collision_damping;
+    }
+
+    next_x[i] = new_x;
+    next_y[i] = new_y;
+    next_vx[i] = new_vx;
+    next_vy[i] = new_vy;
+}
@@ -0,0 +1,63 @@
+#ifndef PARTICLEDATA_H
+#define PARTICLEDATA_H
+
+#include <QPointF>
+#include <QVector2D>
+#include <QSizeF>
+#include <vector>
+
+class ParticleData
+{
+    /**
+      * This class stores the physical state of all the particles as a structure of arrays: each property has its own
+      * contiguous array, and a particle's data is at the same index (its slot) in all of them. The loops of Grid only read
+      * the arrays they need, so they stream through memory instead of following a pointer for each particle.
+      * The particles can be reordered so that neighbors are close in memory: their slots change, but the id returned by add
+      * doesn't, so the rest of the program only knows the ids.
+      * The positions and speeds are double-buffered: update_pos_and_speed reads the current state and writes the next one,
+      * and swap_buffers makes the next state current once all the particles have been updated. This way, the particles
+      * being updated never change the state that their neighbors read, whatever the order (and the thread) they are updated in.
+      */
+
+public:
+    int add(QPointF pos, QVector2D speed);
+    int size() const {return int(x.size());}
+    void reorder(const std::vector<int>& order);
+
+    QPointF get_pos(int i) const {return QPointF(x[i], y[i]);}
+    QVector2D get_speed(int i) const {return QVector2D(vx[i], vy[i]);}
+    QPointF get_predicted_pos(int i) const {return QPointF(px[i], py[i]);}
+
+    void update_predicted_pos(int i, float time_step, float radius, const QSizeF& world_size);
+    void update_pos_and_speed(int i, QVector2D acceleration, float time_step, float radius, float collision_damping,
+                              const QSizeF& world_size);
+    void keep_pos_and_speed(int i) {next_x[i] = x[i]; next_y[i] = y[i]; next_vx[i] = vx[i]; next_vy[i] = vy[i];}
+    void swap_buffers();
+
+public:
+    std::vector<float> x;  // position
+    std::vector<float> y;
+    std::vector<float> vx; // speed
+    std::vector<float> vy;
+    std::vector<float> px; // predicted position
+    std::vector<float> py;
+    std::vector<float> density;
+    std::vector<float> near_density;
+    std::vector<float> pressure; // calculated from the densities once per step, before the forces
+    std::vector<float> near_pressure;
+
+    std::vector<float> next_x; // position and speed at the end of the step being calculated
+    std::vector<float> next_y;
+    std::vector<float> next_vx;
+    std::vector<float> next_vy;
+
+    std::vector<float> last_acceleration; // the norm of the acceleration at the particle's last update, for the time step control
+
+    std::vector<int> ids;   // the id of the particle in each slot
+    std::vector<int> id_slots; // the slot of each particle id (not named slots, which is a Qt keyword)
+
+    std::vector<float> reorder_buffer; // used by reorder, grown with the other arrays so that reordering doesn't allocate
+    std::vector<int> reorder_ids;
+};
+
+#endif // PARTICLEDATA_H
@@ -3,6 +3,7 @@
 #include <QMouseEvent>
 #include "qpainter.h"
 #include "particlesystem.h"
+#include "availablecores.h"
 
 #include <QDebug>
 
@@ -12,36 +13,31 @@ using std::shared_ptr;
 ParticleSystem::ParticleSystem(int _nb_particles, float _particle_radius, float _particle_influence_radius, const QSize& _im_size,
                                QSizeF _world_size, float _time_step, float _g, float _collision_damping, float _fluid_density,
                                float _pressure_multiplier, float _near_pressure_multiplier, float _viscosity_multiplier,
-                               float _interaction_radius, float _interaction_strength, QWidget *parent) :
-         QOpenGLWidget(parent), nb_particles(_nb_particles), particle_radius(_particle_radius), time_step(_time_step),
-         im_size(_im_size), world_size(_world_size), interaction_radius(_interaction_radius), interaction_strength(_interaction_strength)
+                               float _interaction_radius, float _interaction_strength, int _nb_threads, CellStorage _cell_storage, QWidget *parent) :
+         QOpenGLWidget(parent), nb_particles(_nb_particles), time_step(_time_step),
+         im_size(_im_size), world_size(_world_size), available_cores(_nb_threads), interaction_radius(_interaction_radius),
+         interaction_strength(_interaction_strength)
 {
-    particle_influence_radius = make_shared<float>(_particle_influence_radius);
-    g = make_shared<float>(_g);
-    collision_damping = make_shared<float>(_collision_damping);
-    fluid_density = make_shared<float>(_fluid_density);
-    pressure_multiplier = make_shared<float>(_pressure_multiplier);
-    near_pressure_multiplier = make_shared<float>(_near_pressure_multiplier);
-    viscosity_multiplier = make_shared<float>(_viscosity_multiplier);
+    params = {_particle_radius, _particle_influence_radius, _g, _collision_damping, _fluid_density,
+              _pressure_multiplier, _near_pressure_multiplier, _viscosity_multiplier};
+    params_channel = make_shared<SimParamsChannel>(params);
 
     this->setMinimumSize(im_size.width(), im_size.height());
 
-    grid = make_shared<Grid>(QPoint(world_size.width() / *particle_influence_radius,
-                                    world_size.height() / *particle_influence_radius),
+    thread_pool = make_shared<ThreadPool>(_nb_threads);
+
+    grid = make_shared<Grid>(QPoint(world_size.width() / params.influence_radius,
+                                    world_size.height() / params.influence_radius),
                              world_size,
-                             g,
-                             collision_damping,
-                             fluid_density,
-                             pressure_multiplier,
-                             near_pressure_multiplier,
-                             viscosity_multiplier);
+                             params_channel,
+                             thread_pool,
+                             _cell_storage);
 
     int n = qSqrt(nb_particles);
     for (int i = 0; i < n; i++) {
         for (int j = 0; j < n; j++) {
-            shared_ptr<Particle> particle = make_shared<Particle>(particle_radius, particle_influence_radius, QPointF(i * world_size.width() / n, j * world_size.height() / n), QVector2D(0.0, 0.0), grid);
-            grid->add_particle(particle);
-            particles.append(particle);
+            int id = grid->add_particle(QPointF(i * world_size.width() / n, j * world_size.height() / n), QVector2D(0.0, 0.0));
+            particles.append(make_shared<Particle>(id, grid));
         }
     }
 
@@ -49,14 +45,24 @@ ParticleSystem::ParticleSystem(int _nb_particles, float _particle_radius, float
 }
 
 void ParticleSystem::update_physics() {
-    grid->update_particles(time_step, interaction);
+    grid->update_particles_for(time_step, interaction);
     update();
 }
 
+void ParticleSystem::update_available_cores() {
+    // Checks the cores the process may use again, since the CPU quota of its container or its affinity may have changed,
+    // and gives them to the grid
+    const int nb_cores = count_available_cores();
+    if (nb_cores == available_cores) return;
+    available_cores = nb_cores;
+    grid->set_max_threads(available_cores);
+}
+
 void ParticleSystem::set_particles_influence_radius(float _particle_influence_radius) {
-    *particle_influence_radius = _particle_influence_radius;
-    grid->change_grid(QPoint(world_size.width() / *particle_influence_radius,
-                             world_size.height() / *particle_influence_radius));
+    params.influence_radius = _particle_influence_radius;
+    params_channel->publish(params);
+    grid->change_grid(QPoint(world_size.width() / params.influence_radius,
+                             world_size.height() / params.influence_radius));
 }
 
 void ParticleSystem::paintEvent(QPaintEvent* e) {
@@ -67,7 +73,7 @@ void ParticleSystem::paintEvent(QPaintEvent* e) {
     p.drawRect(0, 0, this->width(), this->height());
 
     // draw the particles
-    int particle_draw_radius = particle_radius * im_size.width() / world_size.width();
+    int particle_draw_radius = params.particle_radius * im_size.width() / world_size.width();
     for (auto particle : particles) {
         p.setBrush(QBrush(particle->get_color()));
         p.drawEllipse(world_to_screen(particle->get_pos()), particle_draw_radius, particle_draw_radius);
@@ -7,6 +7,9 @@
 #include <QSizeF>
 #include <memory>
 #include "grid.h"
+#include "particle.h"
+#include "simparams.h"
+#include "threadpool.h"
 #include "interaction.h"
 
 using std::shared_ptr;
@@ -22,7 +25,8 @@ public:
     explicit ParticleSystem(int _nb_particles, float _particle_radius, float _particle_influence_radius, const QSize& _im_size,
                                             QSizeF _world_size, float _time_step, float _g, float _collision_damping, float _fluid_density,
                                             float _pressure_multiplier, float _near_pressure_multiplier, float _viscosity_multiplier,
-                                            float _interaction_radius, float _interaction_strength, QWidget *parent = nullptr);
+                                            float _interaction_radius, float _interaction_strength, int _nb_threads, CellStorage _cell_storage,
+                                            QWidget *parent = nullptr);
 
     void paintEvent(QPaintEvent* e) override;
     void mousePressEvent(QMouseEvent *event) override;
@@ -30,14 +34,26 @@ public:
     void mouseMoveEvent(QMouseEvent *event) override;
 
     void set_particles_influence_radius(float _particle_influence_radius);
-    void set_g(float _g) {*g = _g;}
-    void set_fluid_density(float _fluid_density) {*fluid_density = _fluid_density;}
-    void set_pressure_multiplier(float _pressure_multiplier) {*pressure_multiplier = _pressure_multiplier;}
-    void set_near_pressure_multiplier(float _near_pressure_multiplier) {*near_pressure_multiplier = _near_pressure_multiplier;}
-    void set_viscosity_multiplier(float _viscosity_multiplier) {*viscosity_multiplier = _viscosity_multiplier;}
+    void set_g(float _g) {params.g = _g; params_channel->publish(params);}
+    void set_fluid_density(float _fluid_density) {params.fluid_density = _fluid_density; params_channel->publish(params);}
+    void set_pressure_multiplier(float _pressure_multiplier) {params.pressure_multiplier = _pressure_multiplier; params_channel->publish(params);}
+    void set_near_pressure_multiplier(float _near_pressure_multiplier) {params.near_pressure_multiplier = _near_pressure_multiplier; params_channel->publish(params);}
+    void set_viscosity_multiplier(float _viscosity_multiplier) {params.viscosity_multiplier = _viscosity_multiplier; params_channel->publish(params);}
     void set_interaction_radius(float _interaction_radius) {interaction_radius = _interaction_radius;}
     void set_interaction_strength(float _interaction_strength) {interaction_strength = _interaction_strength;}
-    void set_collision_damping(float _collision_damping) {*collision_damping = _collision_damping;}
+    void set_collision_damping(float _collision_damping) {params.collision_damping = _collision_damping; params_channel->publish(params);}
+    void set_neighbor_list_skin(float skin) {grid->set_neighbor_list_skin(skin);}
+    void set_smoothing_kernel(SmoothingKernel kernel) {grid->set_smoothing_kernel(kernel);}
+    void set_symmetric_forces(bool enabled) {grid->set_symmetric_forces(enabled);}
+    void set_reorder_interval(int steps) {grid->set_reorder_interval(steps);}
+    void set_time_step_factors(float cfl_factor, float force_factor) {grid->set_time_step_factors(cfl_factor, force_factor);}
+    void set_block_time_steps(bool enabled) {grid->set_block_time_steps(enabled);}
+    void set_sleep_thresholds(float speed, float acceleration, int steps) {grid->set_sleep_thresholds(speed, acceleration, steps);}
+    void set_auto_tuning(AutoTuning mode) {grid->set_auto_tuning(mode);}
+
+    void update_available_cores();
+    int get_available_cores() const {return available_cores;}
+    int get_nb_threads() const {return thread_pool->get_nb_threads();}
 
 public slots:
     void update_physics();
@@ -55,19 +71,15 @@ private:
 
 private:
     int nb_particles;
-    float particle_radius;
 
-    shared_ptr<float> particle_influence_radius;
-    shared_ptr<float> g;
-    shared_ptr<float> collision_damping;
-    shared_ptr<float> fluid_density;
-    shared_ptr<float> pressure_multiplier;
-    shared_ptr<float> near_pressure_multiplier;
-    shared_ptr<float> viscosity_multiplier;
-    float time_step;
+    SimParams params; // the physical parameters set by the ui, published to the grid each time they change
+    shared_ptr<SimParamsChannel> params_channel;
+    float time_step; // the simulated time between two frames, which the grid splits in as many steps as needed
 
     QSize im_size;
     QSizeF world_size;
+    int available_cores; // the cores the process may use, checked again from time to time (see count_available_cores)
+    shared_ptr<ThreadPool> thread_pool;
     shared_ptr<Grid> grid;
     QVector<shared_ptr<Particle>> particles;
 
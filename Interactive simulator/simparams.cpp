@@ -0,0 +1,44 @@
+#include <cstring>
+#include <type_traits>
+#include "simparams.h"
+
+static_assert(std::is_trivially_copyable<SimParams>::value && sizeof(SimParams) % sizeof(float) == 0,
+              "SimParams is copied as an array of floats");
+
+SimParamsChannel::SimParamsChannel(const SimParams& params) {
+    publish(params);
+}
+
+void SimParamsChannel::publish(const SimParams& params) {
+    float new_values[nb_values];
+    std::memcpy(new_values, &params, sizeof(SimParams));
+
+    unsigned int start = sequence.load(std::memory_order_relaxed);
+    sequence.store(start + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    for (int k = 0; k < nb_values; k++) {
+        values[k].store(new_values[k], std::memory_order_relaxed);
+    }
+
+    sequence.store(start + 2, std::memory_order_release);
+}
+
+SimParams SimParamsChannel::read() const {
+    float current_values[nb_values];
+    unsigned int start;
+    unsigned int end;
+
+    do {
+        start = sequence.load(std::memory_order_acquire);
+        for (int k = 0; k < nb_values; k++) {
+            current_values[k] = values[k].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        end = sequence.load(std::memory_order_relaxed);
+    } while (start != end || start % 2 == 1);
+
+    SimParams params;
+    std::memcpy(&params, current_values, sizeof(SimParams));
+    return params;
+}
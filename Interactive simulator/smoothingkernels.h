@@ -0,0 +1,133 @@
+#ifndef SMOOTHINGKERNELS_H
+#define SMOOTHINGKERNELS_H
+
+#include <QtMath>
+#include "floatbatch.h"
+
+/**
+  * The smoothing kernels give the influence of a neighbor on a particle, depending on their distance. Each set of kernels
+  * is a type whose coefficients are calculated once for an influence radius, and whose functions are templates that work on
+  * a float as well as on a FloatBatch. Grid's density pass is instantiated for each of these types, so that the kernels
+  * are inlined in it.
+  * The functions are only meaningful for distances smaller than the influence radius: the caller masks the other ones.
+  * Each set provides:
+  * - density: the kernel of the density
+  * - near_density: the steeper kernel of the near density, which prevents the particles from clumping
+  * - slope: the derivative of the density kernel, used for the pressure force
+  * - viscosity: the kernel of the viscosity force
+  */
+
+enum class SmoothingKernel {spiky, wendland_c2, cubic_spline};
+
+struct SpikyKernels
+{
+    /**
+      * The original kernels: (h - r)^2 for the density, (h - r)^3 for the near density, and (h^2 - r^2)^3 for the viscosity
+      */
+
+    float influence_radius = 0;
+    float density_scale = 0;
+    float near_density_scale = 0;
+    float slope_scale = 0;
+
+    SpikyKernels() = default;
+    explicit SpikyKernels(float h) : influence_radius(h),
+                                     density_scale(6 / (M_PI * qPow(h, 4))),
+                                     near_density_scale(10 / (M_PI * qPow(h, 5))),
+                                     slope_scale(-12 / (M_PI * qPow(h, 4))) {}
+
+    template<typename Float>
+    Float density(Float distance) const {
+        Float q = Float(influence_radius) - distance;
+        return q * q * Float(density_scale);
+    }
+
+    template<typename Float>
+    Float near_density(Float distance) const {
+        Float q = Float(influence_radius) - distance;
+        return q * q * q * Float(near_density_scale);
+    }
+
+    template<typename Float>
+    Float slope(Float distance) const {
+        return (Float(influence_radius) - distance) * Float(slope_scale);
+    }
+
+    template<typename Float>
+    Float viscosity(Float distance) const {
+        Float value = Float(influence_radius * influence_radius) - distance * distance;
+        return value * value * value;
+    }
+};
+
+struct WendlandC2Kernels : SpikyKernels
+{
+    /**
+      * The Wendland C2 kernel for the density: (1 - q)^4 (1 + 4q) with q = r / h. It is smooth at the origin, so the particles
+      * do not pair up. The near density and viscosity kernels are the original ones.
+      */
+
+    float wendland_scale = 0;
+    float wendland_slope_scale = 0;
+    float inverse_radius = 0;
+
+    WendlandC2Kernels() = default;
+    explicit WendlandC2Kernels(float h) : SpikyKernels(h),
+                                          wendland_scale(7 / (M_PI * h * h)),
+                                          wendland_slope_scale(-140 / (M_PI * h * h * h)),
+                                          inverse_radius(1 / h) {}
+
+    template<typename Float>
+    Float density(Float distance) const {
+        Float q = distance * Float(inverse_radius);
+        Float a = Float(1) - q;
+        Float a2 = a * a;
+        return a2 * a2 * batch_fma(Float(4), q, Float(1)) * Float(wendland_scale);
+    }
+
+    template<typename Float>
+    Float slope(Float distance) const {
+        Float q = distance * Float(inverse_radius);
+        Float a = Float(1) - q;
+        return q * a * a * a * Float(wendland_slope_scale);
+    }
+};
+
+struct CubicSplineKernels : SpikyKernels
+{
+    /**
+      * The cubic spline (M4) kernel for the density, with a support of one influence radius: 6q^3 - 6q^2 + 1 for q < 1/2,
+      * and 2(1 - q)^3 otherwise, with q = r / h. The near density and viscosity kernels are the original ones.
+      */
+
+    float spline_scale = 0;
+    float spline_slope_scale = 0;
+    float inverse_radius = 0;
+
+    CubicSplineKernels() = default;
+    explicit CubicSplineKernels(float h) : SpikyKernels(h),
+                                           spline_scale(40 / (7 * M_PI * h * h)),
+                                           spline_slope_scale(240 / (7 * M_PI * h * h * h)),
+                                           inverse_radius(1 / h) {}
+
+    template<typename Float>
+    Float density(Float distance) const {
+        Float q = distance * Float(inverse_radius);
+        Float a = Float(1) - q;
+        Float inner = batch_fma(q * q, Float(6) * q - Float(6), Float(1));
+        Float outer = Float(2) * a * a * a;
+        return batch_select(q < Float(0.5f), inner, outer) * Float(spline_scale);
+    }
+
+    template<typename Float>
+    Float slope(Float distance) const {
+        // derivative of 6q^3 - 6q^2 + 1 is 6q(3q - 2), and derivative of 2(1 - q)^3 is -6(1 - q)^2, both divided by h
+        Float q = distance * Float(inverse_radius);
+        Float a = Float(1) - q;
+        Float inner = q * (Float(3) * q - Float(2));
+        Float outer = Float(-1) * a * a;
+        return batch_select(q < Float(0.5f), inner, outer) * Float(spline_slope_scale);
+    }
+};
+
+#endif // SMOOTHINGKERNELS_H
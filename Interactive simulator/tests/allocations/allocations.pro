@@ -0,0 +1,15 @@
+QT       += core gui testlib
+
+CONFIG += c++17 console testcase
+CONFIG -= app_bundle
+
+# Runs the simulation in each of its modes with the allocation check (see allocationcheck.h): the test stops with a fatal
+# error if a step allocates memory once the simulation has warmed up.
+TARGET = tst_allocations
+
+DEFINES += ALLOCATION_CHECK
+
+include(../simulation.pri)
+
+SOURCES += \
+    tst_allocations.cpp
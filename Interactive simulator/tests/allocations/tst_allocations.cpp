@@ -0,0 +1,104 @@
+#include <QtTest>
+#include <functional>
+#include <memory>
+#include "grid.h"
+
+using std::function;
+using std::make_shared;
+
+inline const QSizeF world_size = QSizeF(10.0, 8.0);
+inline constexpr float frame_duration = 0.01;
+inline constexpr int nb_frames = 1000;
+inline constexpr int min_checked_frames = 200; // the frames of a mode that must run after the warm-up of the allocation check
+inline const SimParams params = {0.03f, 0.25f, 12, 0.15f, 120, 135, 8, 8100};
+inline const Interaction interaction = {QPointF(5, 4), 1.0, 50};
+
+class AllocationTest : public QObject
+{
+    /**
+      * These tests run the simulation in each of its modes, built with ALLOCATION_CHECK: Grid stops the program with a fatal
+      * error if a step allocates memory once the simulation has warmed up. Each test also checks that enough frames ran
+      * after the warm-up, so that it does not pass without checking.
+      */
+
+    Q_OBJECT
+
+private slots:
+    void default_mode();
+    void neighbor_lists();
+    void symmetric_forces();
+    void symmetric_forces_with_lists();
+    void adaptive_time_steps();
+    void block_time_steps();
+    void sleeping_cells();
+    void hashed_cells();
+    void half_size_cells();
+    void auto_tuning();
+};
+
+static void run_frames(CellStorage cell_storage, const function<void(Grid&)>& configure) {
+    // Runs a dam break stirred by the interaction, in the mode set by configure
+    Grid grid(QPoint(world_size.width() / params.influence_radius, world_size.height() / params.influence_radius), world_size,
+              make_shared<SimParamsChannel>(params), make_shared<ThreadPool>(4), cell_storage);
+    for (int i = 0; i < 30; i++) {
+        for (int j = 0; j < 30; j++) {
+            grid.add_particle(QPointF(0.5 + 0.1 * i, 0.5 + 0.2 * j), QVector2D(0, 0));
+        }
+    }
+    configure(grid);
+
+    int checked_frames = 0;
+    for (int frame = 0; frame < nb_frames; frame++) {
+        if (grid.is_allocation_checked()) checked_frames++;
+        grid.update_particles_for(frame_duration, interaction);
+    }
+    QVERIFY(checked_frames >= min_checked_frames);
+}
+
+void AllocationTest::default_mode() {
+    run_frames(CellStorage::dense, [](Grid& grid) {grid.set_time_step_factors(0, 0);});
+}
+
+void AllocationTest::neighbor_lists() {
+    run_frames(CellStorage::dense, [](Grid& grid) {grid.set_time_step_factors(0, 0); grid.set_neighbor_list_skin(0.05);});
+}
+
+void AllocationTest::symmetric_forces() {
+    run_frames(CellStorage::dense, [](Grid& grid) {grid.set_time_step_factors(0, 0); grid.set_symmetric_forces(true);});
+}
+
+void AllocationTest::symmetric_forces_with_lists() {
+    run_frames(CellStorage::dense, [](Grid& grid) {
+        grid.set_time_step_factors(0, 0);
+        grid.set_symmetric_forces(true);
+        grid.set_neighbor_list_skin(0.05);
+    });
+}
+
+void AllocationTest::adaptive_time_steps() {
+    run_frames(CellStorage::dense, [](Grid&) {});
+}
+
+void AllocationTest::block_time_steps() {
+    run_frames(CellStorage::dense, [](Grid& grid) {grid.set_block_time_steps(true);});
+}
+
+void AllocationTest::sleeping_cells() {
+    run_frames(CellStorage::dense, [](Grid& grid) {grid.set_time_step_factors(0, 0); grid.set_sleep_thresholds(1.0, 20, 10);});
+}
+
+void AllocationTest::hashed_cells() {
+    run_frames(CellStorage::hashed, [](Grid& grid) {grid.set_time_step_factors(0, 0);});
+}
+
+void AllocationTest::half_size_cells() {
+    run_frames(CellStorage::dense, [](Grid& grid) {grid.set_time_step_factors(0, 0); grid.set_cell_reach(2);});
+}
+
+void AllocationTest::auto_tuning() {
+    run_frames(CellStorage::dense, [](Grid& grid) {grid.set_auto_tuning(AutoTuning::full); grid.set_max_threads(4);});
+}
+
+QTEST_APPLESS_MAIN(AllocationTest)
+
+#include "tst_allocations.moc"
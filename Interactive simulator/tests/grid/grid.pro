@@ -0,0 +1,12 @@
+QT       += core gui testlib
+
+CONFIG += c++17 console testcase
+CONFIG -= app_bundle
+
+# The tests of the simulation's results
+TARGET = tst_grid
+
+include(../simulation.pri)
+
+SOURCES += \
+    tst_grid.cpp
@@ -0,0 +1,196 @@
+#include <QtTest>
+#include <memory>
+#include "grid.h"
+
+using std::make_shared;
+using std::shared_ptr;
+
+inline const QSizeF world_size = QSizeF(10.0, 8.0);
+inline constexpr float influence_radius = 0.25;
+inline constexpr float time_step = 0.01;
+inline const Interaction no_interaction = {QPointF(0, 0), 0, 0};
+
+class GridTest : public QObject
+{
+    /**
+      * These tests run a few steps of small simulations whose outcome is known, for the cases that a whole simulation
+      * would hide in its noise (eg: a pair of neighbors missed now and then).
+      */
+
+    Q_OBJECT
+
+private slots:
+    void neighbor_lists_cover_the_skin();
+    void reorder_keeps_sleeping_densities();
+    void auto_tuning_keeps_threads_until_tuned();
+    void sleeping_fluid_wakes_when_params_change();
+    void symmetric_lists_are_deterministic();
+    void block_time_steps_update_list_neighbors();
+};
+
+static shared_ptr<Grid> create_grid(const SimParams& params, int nb_threads = 2) {
+    return make_shared<Grid>(QPoint(world_size.width() / params.influence_radius, world_size.height() / params.influence_radius),
+                             world_size,
+                             make_shared<SimParamsChannel>(params),
+                             make_shared<ThreadPool>(nb_threads),
+                             CellStorage::dense);
+}
+
+void GridTest::neighbor_lists_cover_the_skin() {
+    // Two particles in cells two apart move 0.024 toward each other at each step, without forces. When the lists are built,
+    // they are 0.251 apart: out of the influence radius, but within the skin of 0.05. At the next step they are 0.203 apart,
+    // and the lists are kept since they moved less than half the skin: they must be neighbors, as they are without lists.
+    const SimParams params = {0.03f, influence_radius, 0, 0, 20, 0, 0, 0};
+    float densities[2];
+    for (int with_lists : {0, 1}) {
+        shared_ptr<Grid> grid = create_grid(params);
+        grid->set_neighbor_list_skin(with_lists ? 0.05 : 0);
+        const int left = grid->add_particle(QPointF(1.225, 4), QVector2D(2.4, 0));
+        grid->add_particle(QPointF(1.524, 4), QVector2D(-2.4, 0));
+        for (int step = 0; step < 2; step++) {
+            grid->update_particles(time_step, no_interaction);
+        }
+        densities[with_lists] = grid->get_particle_density(left);
+    }
+
+    shared_ptr<Grid> lone_grid = create_grid(params);
+    const int lone = lone_grid->add_particle(QPointF(1.225, 4), QVector2D(2.4, 0));
+    lone_grid->update_particles(time_step, no_interaction);
+
+    QVERIFY(densities[0] > lone_grid->get_particle_density(lone));
+    QCOMPARE(densities[1], densities[0]);
+}
+
+void GridTest::reorder_keeps_sleeping_densities() {
+    // The particles of a fluid almost at rest (weak pressure, no gravity) fall asleep, and keep the densities and pressures
+    // of their last update. After the particles are reordered, each one must still have its own.
+    const SimParams params = {0.03f, influence_radius, 0, 0, 20, 0.1, 0.01, 0};
+    shared_ptr<Grid> grid = create_grid(params);
+    grid->set_reorder_interval(0);
+    grid->set_sleep_thresholds(0.1, 2, 5);
+    std::vector<int> ids;
+    for (int i = 0; i < 20; i++) {
+        for (int j = 0; j < 20; j++) {
+            ids.push_back(grid->add_particle(QPointF(3 + 0.1 * i + 0.013 * (j % 3), 3 + 0.1 * j + 0.011 * (i % 4)), QVector2D(0, 0)));
+        }
+    }
+    for (int step = 0; step < 10; step++) {
+        grid->update_particles(time_step, no_interaction);
+    }
+
+    std::vector<float> densities;
+    std::vector<float> pressures;
+    for (int id : ids) {
+        QVERIFY(grid->is_particle_sleeping(id));
+        densities.push_back(grid->get_particle_density(id));
+        pressures.push_back(grid->get_particle_pressure(id));
+    }
+
+    grid->set_reorder_interval(1);
+    grid->update_particles(time_step, no_interaction);
+    for (size_t k = 0; k < ids.size(); k++) {
+        QVERIFY(grid->is_particle_sleeping(ids[k]));
+        QCOMPARE(grid->get_particle_density(ids[k]), densities[k]);
+        QCOMPARE(grid->get_particle_pressure(ids[k]), pressures[k]);
+    }
+}
+
+void GridTest::auto_tuning_keeps_threads_until_tuned() {
+    // With too few particles to tune, the auto-tuner has no measured configuration: the grid must keep its threads instead
+    // of falling back to a single one.
+    const SimParams params = {0.03f, influence_radius, 0, 0, 20, 0, 0, 0};
+    shared_ptr<ThreadPool> thread_pool = make_shared<ThreadPool>(4);
+    Grid grid(QPoint(world_size.width() / params.influence_radius, world_size.height() / params.influence_radius),
+              world_size, make_shared<SimParamsChannel>(params), thread_pool, CellStorage::dense);
+    grid.set_auto_tuning(AutoTuning::full);
+    grid.set_max_threads(4);
+    for (int i = 0; i < 100; i++) {
+        grid.add_particle(QPointF(3 + 0.1 * (i % 10), 3 + 0.1 * (i / 10)), QVector2D(0, 0));
+    }
+    grid.update_particles_for(time_step, no_interaction);
+
+    QCOMPARE(thread_pool->get_nb_threads(), 4);
+}
+
+void GridTest::sleeping_fluid_wakes_when_params_change() {
+    // A fluid at rest without gravity falls asleep. Once gravity is set, every particle must fall, although no neighbor cell
+    // moved and the user didn't interact with it.
+    SimParams params = {0.03f, influence_radius, 0, 0, 20, 0.1, 0.01, 0};
+    shared_ptr<SimParamsChannel> params_channel = make_shared<SimParamsChannel>(params);
+    Grid grid(QPoint(world_size.width() / params.influence_radius, world_size.height() / params.influence_radius), world_size,
+              params_channel, make_shared<ThreadPool>(2), CellStorage::dense);
+    grid.set_sleep_thresholds(0.1, 2, 5);
+    std::vector<int> ids;
+    for (int i = 0; i < 20; i++) {
+        for (int j = 0; j < 20; j++) {
+            ids.push_back(grid.add_particle(QPointF(3 + 0.1 * i + 0.013 * (j % 3), 3 + 0.1 * j + 0.011 * (i % 4)), QVector2D(0, 0)));
+        }
+    }
+    for (int step = 0; step < 10; step++) {
+        grid.update_particles(time_step, no_interaction);
+    }
+
+    std::vector<QPointF> positions;
+    for (int id : ids) {
+        QVERIFY(grid.is_particle_sleeping(id));
+        positions.push_back(grid.get_particle_pos(id));
+    }
+
+    params.g = 10;
+    params_channel->publish(params);
+    for (int step = 0; step < 5; step++) {
+        grid.update_particles(time_step, no_interaction);
+    }
+    for (size_t k = 0; k < ids.size(); k++) {
+        QVERIFY(grid.get_particle_pos(ids[k]) != positions[k]);
+    }
+}
+
+void GridTest::symmetric_lists_are_deterministic() {
+    // With a skin of 0.2, the lists reach two columns of cells away, further than the stencil: the symmetric engine must
+    // still give the same result with one thread and with several ones, whose columns then never write the same particles.
+    // The particles start fast so that their predicted positions, which the pairs use, often lie beyond their cell.
+    const SimParams params = {0.03f, influence_radius, 12, 0.15f, 120, 135, 8, 8100};
+    const Interaction interaction = {QPointF(5, 2), 1.0, 50};
+    std::vector<QPointF> positions[2];
+    for (int run = 0; run < 2; run++) {
+        shared_ptr<Grid> grid = create_grid(params, run == 0 ? 1 : 4);
+        grid->set_symmetric_forces(true);
+        grid->set_neighbor_list_skin(0.2);
+        std::vector<int> ids;
+        for (int i = 0; i < 40; i++) {
+            for (int j = 0; j < 20; j++) {
+                ids.push_back(grid->add_particle(QPointF(0.5 + 0.1 * i, 0.5 + 0.1 * j), QVector2D((i + j) % 2 ? 20 : -20, 0)));
+            }
+        }
+        for (int step = 0; step < 100; step++) {
+            grid->update_particles(time_step, interaction);
+        }
+        for (int id : ids) {
+            positions[run].push_back(grid->get_particle_pos(id));
+        }
+    }
+
+    QVERIFY(positions[1] == positions[0]);
+}
+
+void GridTest::block_time_steps_update_list_neighbors() {
+    // A fast particle comes within the influence radius of one at rest, whose block spans the frame. When the lists are built,
+    // they are in cells two apart, where the lists keep them until they are rebuilt. The density of the particle at rest must
+    // still be updated at each fine step of the fast one, which reads its pressure: as the two are alone, it must then be the
+    // density of the fast one.
+    const SimParams params = {0.03f, influence_radius, 0, 0, 20, 10, 1, 0};
+    shared_ptr<Grid> grid = create_grid(params);
+    grid->set_block_time_steps(true);
+    grid->set_neighbor_list_skin(0.5);
+    const int fast = grid->add_particle(QPointF(1.24, 4), QVector2D(6, 0));
+    const int rest = grid->add_particle(QPointF(1.51, 4), QVector2D(0, 0));
+    grid->update_particles(0.0001, no_interaction); // gives the time step control the speed of the fast particle
+    grid->update_particles_for(0.04, no_interaction);
+
+    QCOMPARE(grid->get_particle_density(rest), grid->get_particle_density(fast));
+}
+
+QTEST_APPLESS_MAIN(GridTest)
+
+#include "tst_grid.moc"
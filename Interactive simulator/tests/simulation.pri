@@ -0,0 +1,28 @@
+# The simulation's sources, shared by the tests: they build the grid from the Interactive simulator's directory, without the
+# user interface.
+INCLUDEPATH += $$PWD/..
+
+SOURCES += \
+    $$PWD/../allocationcheck.cpp \
+    $$PWD/../autotuner.cpp \
+    $$PWD/../availablecores.cpp \
+    $$PWD/../cellhashtable.cpp \
+    $$PWD/../grid.cpp \
+    $$PWD/../neighborlist.cpp \
+    $$PWD/../particledata.cpp \
+    $$PWD/../simparams.cpp \
+    $$PWD/../threadpool.cpp
+
+HEADERS += \
+    $$PWD/../allocationcheck.h \
+    $$PWD/../autotuner.h \
+    $$PWD/../availablecores.h \
+    $$PWD/../cellhashtable.h \
+    $$PWD/../floatbatch.h \
+    $$PWD/../grid.h \
+    $$PWD/../interaction.h \
+    $$PWD/../neighborlist.h \
+    $$PWD/../particledata.h \
+    $$PWD/../simparams.h \
+    $$PWD/../smoothingkernels.h \
+    $$PWD/../threadpool.h
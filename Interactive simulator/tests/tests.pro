@@ -0,0 +1,8 @@
+# The tests of the simulation (run them with "make check"):
+# - grid: small simulations whose outcome is known.
+# - allocations: the simulation's modes, built with the allocation check.
+TEMPLATE = subdirs
+
+SUBDIRS += \
+    grid \
+    allocations
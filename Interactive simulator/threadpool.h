@@ -0,0 +1,77 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+    /**
+      * This class owns a set of worker threads that live as long as the pool, so that the simulation doesn't create and
+      * destroy threads at each step. The work is given as a parallel for: the tasks are shared between the workers and the
+      * calling thread, and parallel_for returns once all of them are done, which acts as a barrier between two phases.
+      * Each thread starts with a contiguous range of the tasks, which it runs from the front. A thread that runs out of tasks
+      * steals the back half of another thread's range, so the threads stay busy when some tasks take longer than others,
+      * while mostly running neighboring tasks (eg: neighboring tiles of the grid).
+      */
+
+public:
+    explicit ThreadPool(int _nb_threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int get_nb_threads() const {return nb_threads;}
+    void set_nb_threads(int _nb_threads);
+
+    // Calls task_function(task, thread) for each task in [0, nb_tasks), thread being in [0, get_nb_threads())
+    template<typename Function>
+    void parallel_for(int nb_tasks, const Function& task_function) {
+        run(nb_tasks, &call<Function>, &task_function);
+    }
+
+private:
+    using TaskCaller = void (*)(const void* function, int task, int thread);
+
+    template<typename Function>
+    static void call(const void* function, int task, int thread) {
+        (*static_cast<const Function*>(function))(task, thread);
+    }
+
+    void run(int nb_tasks, TaskCaller caller, const void* function);
+    void run_tasks(int thread);
+    bool pop_task(int thread, int& task);
+    bool steal_tasks(int thread, int victim);
+    void worker_loop(int thread, unsigned int seen_generation);
+    void start_workers();
+    void stop_workers();
+
+private:
+    int nb_threads;
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable start_condition;
+    std::condition_variable done_condition;
+    bool stopping = false;
+    std::atomic<unsigned int> generation {0}; // incremented each time a parallel for starts
+
+    TaskCaller task_caller = nullptr;
+    const void* task_function = nullptr;
+    int nb_tasks = 0;
+    std::atomic<int> busy_workers {0};
+
+    struct alignas(64) TaskRange {
+        // The remaining tasks of a thread, [begin, end) packed in one word so that the owner and the thieves update it
+        // with a single compare and swap. Each range has its own cache line, so the threads don't slow each other down.
+        std::atomic<std::uint64_t> tasks {0};
+    };
+    std::vector<TaskRange> task_ranges;
+};
+
+#endif // THREADPOOL_H